@@ -0,0 +1,323 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+
+// Benchmark of the file system. Runs workloads on a freshly formatted
+// disk file and prints, for each of them, ops/sec, p50/p99 latency and
+// the blocks read and written per operation as JSON:
+//     fsbench [--disk <file>] [--blocks <n>] [--cache <n>] [--seed <n>] [--scale <n>]
+//             [workload ...]
+// Without workloads all of them run. The workloads only depend on the
+// seed and the scale, so runs with the same arguments do the same work
+// and can be compared. The disk is synced after each workload and the
+// blocks written by the sync are counted, the time of the sync is not.
+
+// blocks of the benchmark disk, 64 MiB
+#define BENCH_BLOCKS 16384
+#define BENCH_DISK "fsbench.bin"
+
+struct bench_result {
+    std::string name;
+    std::vector<double> latencies;  // microseconds, one per operation
+    unsigned errors;
+    double seconds;
+    unsigned long blocks_read;
+    unsigned long blocks_written;
+};
+
+// times the operations of one workload and counts the disk blocks they move
+class Bench {
+private:
+    FS &fs;
+    bench_result result;
+    unsigned long read_start, written_start;
+    std::chrono::steady_clock::time_point start;
+public:
+    Bench(FS &fs, const std::string& name) : fs(fs) {
+        result.name = name;
+        result.errors = 0;
+        read_start = fs.get_blocks_read();
+        written_start = fs.get_blocks_written();
+        start = std::chrono::steady_clock::now();
+    }
+    // runs one timed operation, a negative return value is an error
+    template <typename F> void op(F f) {
+        auto t0 = std::chrono::steady_clock::now();
+        int ret_val = f();
+        auto t1 = std::chrono::steady_clock::now();
+        result.latencies.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        if (ret_val < 0)
+            result.errors++;
+    }
+    bench_result done() {
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        fs.sync();
+        result.blocks_read = fs.get_blocks_read() - read_start;
+        result.blocks_written = fs.get_blocks_written() - written_start;
+        return result;
+    }
+};
+
+struct bench_config {
+    unsigned scale;
+    unsigned seed;
+    int null_fd;    // /dev/null, where cat output goes
+};
+
+static std::string content(std::mt19937& rng, size_t len) {
+    std::string data(len, '\0');
+    for (auto& c : data)
+        c = 'a' + rng() % 26;
+    return data;
+}
+
+// many small files in one directory
+static bench_result small_create(FS& fs, const bench_config& cfg) {
+    std::mt19937 rng(cfg.seed);
+    std::string data = content(rng, 100);
+    Bench b(fs, "small_create");
+    for (unsigned i = 0; i < 2000 * cfg.scale; i++)
+        b.op([&] { return fs.create("s" + std::to_string(i), data.data(), data.size()); });
+    return b.done();
+}
+
+// large files written in one go
+static bench_result large_create(FS& fs, const bench_config& cfg) {
+    std::mt19937 rng(cfg.seed);
+    std::string data = content(rng, 4 << 20);
+    Bench b(fs, "large_create");
+    for (unsigned i = 0; i < 8 * cfg.scale; i++)
+        b.op([&] { return fs.create("l" + std::to_string(i), data.data(), data.size()); });
+    return b.done();
+}
+
+// large files read from start to end
+static bench_result large_cat(FS& fs, const bench_config& cfg) {
+    std::mt19937 rng(cfg.seed);
+    std::string data = content(rng, 4 << 20);
+    unsigned files = 4 * cfg.scale;
+    for (unsigned i = 0; i < files; i++)
+        fs.create("l" + std::to_string(i), data.data(), data.size());
+    fs.sync();
+    Bench b(fs, "large_cat");
+    for (unsigned i = 0; i < 4 * files; i++)
+        b.op([&] { return fs.read_to_fd("l" + std::to_string(i % files), cfg.null_fd); });
+    return b.done();
+}
+
+// a chain of nested directories, each operation is a mkdir and a cd
+static bench_result deep_mkdir(FS& fs, const bench_config& cfg) {
+    Bench b(fs, "deep_mkdir");
+    for (unsigned i = 0; i < 500 * cfg.scale; i++)
+        b.op([&] { return fs.mkdir("d" + std::to_string(i)) || fs.cd("d" + std::to_string(i)) ? -1 : 0; });
+    bench_result r = b.done();
+    fs.cd("/");
+    return r;
+}
+
+// random copies, renames and removes over a set of files
+static bench_result cp_mv_churn(FS& fs, const bench_config& cfg) {
+    std::mt19937 rng(cfg.seed);
+    std::vector<std::string> names;
+    unsigned next = 0;
+    fs.mkdir("dir");
+    for (unsigned i = 0; i < 200; i++) {
+        std::string data = content(rng, 1 + rng() % 20000);
+        names.push_back("c" + std::to_string(next++));
+        fs.create(names.back(), data.data(), data.size());
+    }
+    Bench b(fs, "cp_mv_churn");
+    for (unsigned i = 0; i < 3000 * cfg.scale; i++) {
+        unsigned pick = rng() % names.size();
+        switch (rng() % 3) {
+        case 0:
+            names.push_back("c" + std::to_string(next++));
+            b.op([&] { return fs.cp(names[pick], names.back()); });
+            break;
+        case 1: {
+            // renames, moving the file in or out of dir half of the time
+            std::string dest = (rng() % 2 ? "dir/c" : "c") + std::to_string(next++);
+            b.op([&] { return fs.mv(names[pick], dest); });
+            names[pick] = dest;
+            break;
+        }
+        case 2:
+            if (names.size() < 100)
+                continue;
+            b.op([&] { return fs.rm(names[pick]); });
+            names.erase(names.begin() + pick);
+            break;
+        }
+    }
+    return b.done();
+}
+
+// records appended one at a time to the end of a log
+static bench_result append_log(FS& fs, const bench_config& cfg) {
+    std::mt19937 rng(cfg.seed);
+    std::string record = content(rng, 127) + "\n";
+    fs.create("record", record.data(), record.size());
+    fs.create("log", record.data(), record.size());
+    Bench b(fs, "append_log");
+    for (unsigned i = 0; i < 5000 * cfg.scale; i++)
+        b.op([&] { return fs.append("record", "log"); });
+    return b.done();
+}
+
+// files written and read back on a disk aged by many creates and removes
+// of random sizes, so that free blocks are scattered
+static bench_result aged_create(FS& fs, const bench_config& cfg) {
+    std::mt19937 rng(cfg.seed);
+    std::vector<std::string> live;
+    unsigned next = 0;
+    for (unsigned round = 0; round < 6000; round++) {
+        if (live.size() > 400 || (live.size() > 0 && rng() % 3 == 0)) {
+            unsigned pick = rng() % live.size();
+            fs.rm(live[pick]);
+            live[pick] = live.back();
+            live.pop_back();
+        } else {
+            std::string data = content(rng, 1 + rng() % 40000);
+            live.push_back("a" + std::to_string(next++));
+            fs.create(live.back(), data.data(), data.size());
+        }
+    }
+    fs.sync();
+    std::string data = content(rng, 256 << 10);
+    Bench b(fs, "aged_create");
+    for (unsigned i = 0; i < 40 * cfg.scale; i++) {
+        std::string name = "n" + std::to_string(i);
+        b.op([&] { return fs.create(name, data.data(), data.size()); });
+        b.op([&] { return fs.read_to_fd(name, cfg.null_fd); });
+        b.op([&] { return fs.rm(name); });
+    }
+    return b.done();
+}
+
+struct workload {
+    const char *name;
+    bench_result (*run)(FS& fs, const bench_config& cfg);
+};
+
+static const workload workloads[] = {
+    {"small_create", small_create},
+    {"large_create", large_create},
+    {"large_cat", large_cat},
+    {"deep_mkdir", deep_mkdir},
+    {"cp_mv_churn", cp_mv_churn},
+    {"append_log", append_log},
+    {"aged_create", aged_create},
+};
+
+// nearest-rank percentile of sorted values
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[(size_t)(p / 100 * (sorted.size() - 1) + 0.5)];
+}
+
+static void print_result(std::ostream& out, const bench_result& r) {
+    std::vector<double> sorted = r.latencies;
+    std::sort(sorted.begin(), sorted.end());
+    double ops = sorted.size();
+    out << "    {\"name\": \"" << r.name << "\""
+        << ", \"ops\": " << sorted.size()
+        << ", \"errors\": " << r.errors
+        << ", \"seconds\": " << r.seconds
+        << ", \"ops_per_sec\": " << (r.seconds > 0 ? ops / r.seconds : 0)
+        << ", \"p50_us\": " << percentile(sorted, 50)
+        << ", \"p99_us\": " << percentile(sorted, 99)
+        << ", \"blocks_read_per_op\": " << (ops ? r.blocks_read / ops : 0)
+        << ", \"blocks_written_per_op\": " << (ops ? r.blocks_written / ops : 0)
+        << "}";
+}
+
+static int usage() {
+    std::cerr << "Usage: fsbench [--disk <file>] [--blocks <n>] [--cache <n>] [--seed <n>] [--scale <n>] [workload ...]\n";
+    std::cerr << "workloads:";
+    for (const auto& w : workloads)
+        std::cerr << " " << w.name;
+    std::cerr << "\n";
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    std::string disk = BENCH_DISK;
+    unsigned blocks = BENCH_BLOCKS;
+    unsigned cache_blocks = CACHE_BLOCKS;
+    bench_config cfg = {1, 1, -1};
+    std::vector<const workload*> selected;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") == 0) {
+            if (i + 1 == argc)
+                return usage();
+            std::string value = argv[++i];
+            unsigned long n = strtoul(value.c_str(), nullptr, 10);
+            if (arg == "--disk")
+                disk = value;
+            else if (arg == "--blocks" && n > 0)
+                blocks = n;
+            else if (arg == "--cache" && n > 0)
+                cache_blocks = n;
+            else if (arg == "--seed")
+                cfg.seed = n;
+            else if (arg == "--scale" && n > 0)
+                cfg.scale = n;
+            else
+                return usage();
+            continue;
+        }
+        const workload *w = nullptr;
+        for (const auto& candidate : workloads) {
+            if (arg == candidate.name)
+                w = &candidate;
+        }
+        if (!w)
+            return usage();
+        selected.push_back(w);
+    }
+    if (selected.empty()) {
+        for (const auto& w : workloads)
+            selected.push_back(&w);
+    }
+    cfg.null_fd = open("/dev/null", O_WRONLY);
+
+    // the file system reports on std::cout, keep that out of the JSON
+    std::ostream out(std::cout.rdbuf());
+    std::cout.rdbuf(nullptr);
+
+    out << "{\n  \"block_size\": " << BLOCK_SIZE
+        << ",\n  \"disk_blocks\": " << blocks
+        << ",\n  \"cache_blocks\": " << cache_blocks
+        << ",\n  \"seed\": " << cfg.seed
+        << ",\n  \"scale\": " << cfg.scale
+        << ",\n  \"workloads\": [\n";
+    unlink(disk.c_str());
+    int ret_val = 0;
+    for (size_t i = 0; i < selected.size(); i++) {
+        bench_result r;
+        {
+            FS fs(disk, blocks, cache_blocks);
+            fs.format();
+            r = selected[i]->run(fs, cfg);
+        }
+        unlink(disk.c_str());
+        if (r.errors)
+            ret_val = 1;
+        print_result(out, r);
+        out << (i + 1 < selected.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+
+    std::cout.rdbuf(out.rdbuf());
+    close(cfg.null_fd);
+    return ret_val;
+}
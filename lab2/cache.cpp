@@ -0,0 +1,432 @@
+#include <iostream>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
+#include "cache.h"
+
+
+Cache::Cache(Disk &disk, unsigned capacity) : disk(disk)
+{
+    // a shard needs room for one block more than the one being used
+    for (auto &s : shards) {
+        s.capacity = std::max(capacity / CACHE_SHARDS, 2u);
+        s.hits = 0;
+        s.misses = 0;
+        s.writebacks = 0;
+        s.readaheads = 0;
+    }
+    collecting = false;
+    next_tag = 0;
+}
+
+Cache::~Cache()
+{
+    // the readahead buffers must outlive their requests
+    {
+        std::unique_lock<std::mutex> lock(aio_lock);
+        while (!ra_runs.empty())
+            collect(lock);
+    }
+    sync();
+}
+
+int Cache::writeback(shard &s, cache_block &cb) {
+    if (!cb.dirty || cb.pinned)
+        return 0;
+    if (disk.write(cb.block_no, cb.data))
+        return -1;
+    cb.dirty = false;
+    cb.dirty_lo = BLOCK_SIZE;
+    cb.dirty_hi = 0;
+    s.writebacks++;
+    return 0;
+}
+
+Cache::cache_block *Cache::lookup(shard &s, unsigned block_no, bool load) {
+    auto it = s.blocks.find(block_no);
+    if (it != s.blocks.end()) {
+        s.hits++;
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        return &s.lru.front();
+    }
+    s.misses++;
+
+    cache_block *cb = allocate(s, block_no);
+    if (!cb)
+        return nullptr;
+    if (load && disk.read(block_no, cb->data)) {
+        s.blocks.erase(block_no);
+        s.lru.pop_front();
+        return nullptr;
+    }
+    return cb;
+}
+
+Cache::cache_block *Cache::allocate(shard &s, unsigned block_no) {
+    // reuse the least recently used block that is not pinned when the
+    // shard is full, or grow past the capacity if all of them are
+    auto victim = s.lru.end();
+    if (s.lru.size() >= s.capacity) {
+        for (auto it = s.lru.rbegin(); it != s.lru.rend(); ++it) {
+            if (!it->pinned) {
+                victim = std::prev(it.base());
+                break;
+            }
+        }
+    }
+    if (victim != s.lru.end()) {
+        if (writeback(s, *victim))
+            return nullptr;
+        s.blocks.erase(victim->block_no);
+        s.lru.splice(s.lru.begin(), s.lru, victim);
+    } else {
+        s.lru.emplace_front();
+    }
+    cache_block &cb = s.lru.front();
+    cb.block_no = block_no;
+    cb.dirty = false;
+    cb.pinned = false;
+    cb.dirty_lo = BLOCK_SIZE;
+    cb.dirty_hi = 0;
+    s.blocks[block_no] = s.lru.begin();
+    return &cb;
+}
+
+int Cache::read(unsigned block_no, uint8_t *blk) {
+    shard &s = shard_of(block_no);
+    std::unique_lock<std::mutex> lock(s.lock);
+    wait_block(s, block_no, lock);
+    cache_block *cb = lookup(s, block_no, true);
+    if (!cb)
+        return -1;
+    std::memcpy(blk, cb->data, BLOCK_SIZE);
+    return 0;
+}
+
+int Cache::write(unsigned block_no, uint8_t *blk) {
+    if (block_no >= disk.get_no_blocks()) {
+        std::cout << "Cache::write - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    shard &s = shard_of(block_no);
+    std::unique_lock<std::mutex> lock(s.lock);
+    wait_block(s, block_no, lock);
+    // the whole block is overwritten, so a miss does not need a disk read
+    cache_block *cb = lookup(s, block_no, false);
+    if (!cb)
+        return -1;
+    std::memcpy(cb->data, blk, BLOCK_SIZE);
+    cb->dirty = true;
+    cb->dirty_lo = 0;
+    cb->dirty_hi = BLOCK_SIZE;
+    return 0;
+}
+
+int Cache::read_range(unsigned block_no, unsigned offset, void *data, unsigned len) {
+    if (offset + len > BLOCK_SIZE)
+        return -1;
+    shard &s = shard_of(block_no);
+    std::unique_lock<std::mutex> lock(s.lock);
+    wait_block(s, block_no, lock);
+    cache_block *cb = lookup(s, block_no, true);
+    if (!cb)
+        return -1;
+    std::memcpy(data, cb->data + offset, len);
+    return 0;
+}
+
+int Cache::write_range(unsigned block_no, unsigned offset, const void *data, unsigned len) {
+    if (offset + len > BLOCK_SIZE || block_no >= disk.get_no_blocks())
+        return -1;
+    shard &s = shard_of(block_no);
+    std::unique_lock<std::mutex> lock(s.lock);
+    wait_block(s, block_no, lock);
+    cache_block *cb = lookup(s, block_no, true);
+    if (!cb)
+        return -1;
+    std::memcpy(cb->data + offset, data, len);
+    cb->dirty = true;
+    cb->dirty_lo = std::min(cb->dirty_lo, offset);
+    cb->dirty_hi = std::max(cb->dirty_hi, offset + len);
+    return 0;
+}
+
+int Cache::readv(std::vector<disk_iovec>& iov) {
+    return transfer(iov, false);
+}
+
+int Cache::writev(std::vector<disk_iovec>& iov) {
+    return transfer(iov, true);
+}
+
+int Cache::transfer(std::vector<disk_iovec>& iov, bool write) {
+    std::vector<disk_iovec> uncached;
+    std::vector<size_t> index;
+    for (size_t i = 0; i < iov.size(); i++) {
+        shard &s = shard_of(iov[i].block_no);
+        std::unique_lock<std::mutex> lock(s.lock);
+        wait_block(s, iov[i].block_no, lock);
+        auto it = s.blocks.find(iov[i].block_no);
+        if (it == s.blocks.end()) {
+            s.misses++;
+            uncached.push_back(iov[i]);
+            index.push_back(i);
+            continue;
+        }
+        s.hits++;
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        cache_block &cb = s.lru.front();
+        if (write) {
+            std::memcpy(cb.data, iov[i].blk, BLOCK_SIZE);
+            cb.dirty = true;
+            cb.dirty_lo = 0;
+            cb.dirty_hi = BLOCK_SIZE;
+        } else {
+            std::memcpy(iov[i].blk, cb.data, BLOCK_SIZE);
+        }
+        iov[i].status = 0;
+    }
+    if (uncached.empty())
+        return 0;
+    int failed = write ? disk.writev(uncached) : disk.readv(uncached);
+    for (size_t i = 0; i < uncached.size(); i++)
+        iov[index[i]].status = uncached[i].status;
+    return failed;
+}
+
+int Cache::readahead(const std::vector<unsigned>& block_nos) {
+    std::unique_lock<std::mutex> lock(aio_lock);
+    readahead_run run = {0, 0, {}};
+    // adds the blocks of a run to (or takes them out of) the blocks
+    // being read
+    auto mark = [&](const readahead_run& r, bool reading) {
+        for (unsigned i = 0; i < r.count; i++) {
+            shard &s = shard_of(r.block_no + i);
+            std::lock_guard<std::mutex> shard_lock(s.lock);
+            if (reading)
+                s.reading.insert(r.block_no + i);
+            else
+                s.reading.erase(r.block_no + i);
+        }
+    };
+    auto start = [&]() {
+        if (run.count == 0)
+            return 0;
+        uint64_t tag = READAHEAD_TAG | next_tag++;
+        readahead_run &r = ra_runs[tag];
+        r = std::move(run);
+        run = {0, 0, {}};
+        r.buf.resize((size_t)r.count * BLOCK_SIZE);
+        mark(r, true);
+        if (disk.submit({r.block_no, r.count, r.buf.data(), false, tag, 0})) {
+            mark(r, false);
+            ra_runs.erase(tag);
+            return -1;
+        }
+        return 0;
+    };
+    for (unsigned block_no : block_nos) {
+        bool cached;
+        {
+            shard &s = shard_of(block_no);
+            std::lock_guard<std::mutex> shard_lock(s.lock);
+            cached = s.blocks.count(block_no) || s.reading.count(block_no);
+        }
+        if (block_no >= disk.get_no_blocks() || cached) {
+            if (start())
+                return -1;
+            continue;
+        }
+        if (run.count > 0 && block_no == run.block_no + run.count) {
+            run.count++;
+            continue;
+        }
+        if (start())
+            return -1;
+        run.block_no = block_no;
+        run.count = 1;
+    }
+    return start();
+}
+
+int Cache::submit(const disk_aio& req) {
+    std::lock_guard<std::mutex> lock(aio_lock);
+    std::thread::id self = std::this_thread::get_id();
+    disk_aio r = req;
+    r.tag = next_tag++;
+    aio_tags[r.tag] = {self, req.tag};
+    if (disk.submit(r)) {
+        aio_tags.erase(r.tag);
+        return -1;
+    }
+    aio_in_flight[self]++;
+    return 0;
+}
+
+int Cache::reap(std::vector<disk_aio>& done, unsigned min_done) {
+    std::unique_lock<std::mutex> lock(aio_lock);
+    std::thread::id self = std::this_thread::get_id();
+    std::deque<disk_aio> &mine = aio_done[self];
+    unsigned &running = aio_in_flight[self];
+    if (min_done > running + mine.size())
+        min_done = running + mine.size();
+    while (mine.size() < min_done)
+        collect(lock);
+    int n = mine.size();
+    done.insert(done.end(), mine.begin(), mine.end());
+    mine.clear();
+    return n;
+}
+
+void Cache::collect(std::unique_lock<std::mutex>& lock) {
+    if (collecting) {
+        aio_cv.wait(lock);
+        return;
+    }
+    collecting = true;
+    lock.unlock();
+    std::vector<disk_aio> done;
+    disk.reap(done, 1);
+    lock.lock();
+
+    // blocks read ahead are in the cache before anyone waiting for them
+    // is woken up
+    std::vector<std::pair<disk_aio, readahead_run>> arrived;
+    for (auto &d : done) {
+        if (d.tag & READAHEAD_TAG) {
+            auto it = ra_runs.find(d.tag);
+            arrived.emplace_back(d, std::move(it->second));
+            ra_runs.erase(it);
+        }
+    }
+    lock.unlock();
+    for (auto &a : arrived)
+        install(a.first, a.second);
+    lock.lock();
+
+    // hand the other requests to the threads that submitted them
+    for (auto &d : done) {
+        if (d.tag & READAHEAD_TAG)
+            continue;
+        auto it = aio_tags.find(d.tag);
+        aio_owner owner = it->second;
+        aio_tags.erase(it);
+        d.tag = owner.tag;
+        aio_done[owner.thread].push_back(d);
+        aio_in_flight[owner.thread]--;
+    }
+    collecting = false;
+    aio_cv.notify_all();
+}
+
+// adds the blocks of a finished readahead to the cache, except those that
+// were loaded or written in the meantime, and ends the wait for them
+void Cache::install(const disk_aio& done, readahead_run& run) {
+    for (unsigned i = 0; i < run.count; i++) {
+        unsigned block_no = run.block_no + i;
+        shard &s = shard_of(block_no);
+        std::lock_guard<std::mutex> lock(s.lock);
+        s.reading.erase(block_no);
+        if (done.status || s.blocks.count(block_no))
+            continue;
+        cache_block *cb = allocate(s, block_no);
+        if (!cb)
+            continue;
+        std::memcpy(cb->data, &run.buf[(size_t)i * BLOCK_SIZE], BLOCK_SIZE);
+        s.readaheads++;
+    }
+}
+
+void Cache::wait_block(shard &s, unsigned block_no, std::unique_lock<std::mutex>& lock) {
+    while (s.reading.count(block_no)) {
+        // the aio lock comes before the shard lock
+        lock.unlock();
+        std::unique_lock<std::mutex> aio(aio_lock);
+        bool reading;
+        {
+            std::lock_guard<std::mutex> shard_lock(s.lock);
+            reading = s.reading.count(block_no);
+        }
+        if (reading)
+            collect(aio);
+        aio.unlock();
+        lock.lock();
+    }
+}
+
+int Cache::peek(unsigned block_no, uint8_t *blk) {
+    shard &s = shard_of(block_no);
+    std::lock_guard<std::mutex> lock(s.lock);
+    auto it = s.blocks.find(block_no);
+    if (it == s.blocks.end())
+        return -1;
+    std::memcpy(blk, it->second->data, BLOCK_SIZE);
+    return 0;
+}
+
+int Cache::pin(unsigned block_no) {
+    shard &s = shard_of(block_no);
+    std::lock_guard<std::mutex> lock(s.lock);
+    auto it = s.blocks.find(block_no);
+    if (it == s.blocks.end())
+        return -1;
+    if (it->second->pinned)
+        return 0;
+    it->second->pinned = true;
+    s.pinned.push_back(block_no);
+    return 1;
+}
+
+void Cache::unpin_all() {
+    for (auto &s : shards) {
+        std::lock_guard<std::mutex> lock(s.lock);
+        for (unsigned block_no : s.pinned) {
+            auto it = s.blocks.find(block_no);
+            if (it != s.blocks.end()) {
+                it->second->pinned = false;
+                it->second->dirty_lo = BLOCK_SIZE;
+                it->second->dirty_hi = 0;
+            }
+        }
+        s.pinned.clear();
+    }
+}
+
+int Cache::dirty_range(unsigned block_no, unsigned *lo, unsigned *hi) {
+    shard &s = shard_of(block_no);
+    std::lock_guard<std::mutex> lock(s.lock);
+    auto it = s.blocks.find(block_no);
+    if (it == s.blocks.end())
+        return -1;
+    *lo = it->second->dirty_lo;
+    *hi = it->second->dirty_hi;
+    return 0;
+}
+
+int Cache::flush() {
+    int ret = 0;
+    for (auto &s : shards) {
+        std::lock_guard<std::mutex> lock(s.lock);
+        for (auto &cb : s.lru) {
+            if (writeback(s, cb))
+                ret = -1;
+        }
+    }
+    return ret;
+}
+
+int Cache::sync() {
+    int ret = flush();
+    if (disk.sync())
+        ret = -1;
+    return ret;
+}
+
+unsigned long Cache::sum(unsigned long shard::*counter) {
+    unsigned long n = 0;
+    for (auto &s : shards) {
+        std::lock_guard<std::mutex> lock(s.lock);
+        n += s.*counter;
+    }
+    return n;
+}
@@ -0,0 +1,144 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "disk.h"
+
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// default number of blocks kept in the block cache
+#define CACHE_BLOCKS 64
+// the cache is split into this many shards by block number, each with its
+// own lock and LRU list
+#define CACHE_SHARDS 8
+// tags of readahead requests have this bit set
+#define READAHEAD_TAG (1ull << 63)
+
+// Write-back block cache in front of the Disk. Blocks are kept in LRU
+// order; written blocks are only marked dirty and go to the disk when
+// they are evicted or when sync() is called. Pinned blocks are never
+// evicted or written back until they are unpinned, this is how the
+// journal keeps uncommitted metadata off the disk.
+//
+// Asynchronous requests to the Disk go through the cache, so that blocks
+// read ahead can be added to it when they arrive. A block that is being
+// read ahead is waited for before it is used.
+//
+// All methods can be called from several threads. Each shard has a lock,
+// the asynchronous requests have one more, which a block access only
+// takes while the block is being read ahead.
+class Cache {
+private:
+    struct cache_block {
+        unsigned block_no;
+        bool dirty;
+        bool pinned;
+        // bytes changed since the block was last written back or unpinned
+        unsigned dirty_lo, dirty_hi;
+        uint8_t data[BLOCK_SIZE];
+    };
+    struct shard {
+        std::mutex lock;
+        unsigned capacity;
+        // most recently used block first
+        std::list<cache_block> lru;
+        std::unordered_map<unsigned, std::list<cache_block>::iterator> blocks;
+        std::vector<unsigned> pinned;
+        // blocks being read ahead, a block in here is waited for
+        std::unordered_set<unsigned> reading;
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long writebacks;
+        unsigned long readaheads;
+    };
+    Disk &disk;
+    shard shards[CACHE_SHARDS];
+    shard &shard_of(unsigned block_no) { return shards[block_no % CACHE_SHARDS]; }
+    // consecutive blocks being read ahead, keyed by request tag
+    struct readahead_run {
+        unsigned block_no;
+        unsigned count;
+        std::vector<uint8_t> buf;
+    };
+    // who submitted a request through submit(), keyed by request tag
+    struct aio_owner {
+        std::thread::id thread;
+        uint64_t tag;
+    };
+    std::mutex aio_lock;
+    std::condition_variable aio_cv;
+    bool collecting;    // a thread is reaping the disk
+    std::unordered_map<uint64_t, readahead_run> ra_runs;
+    std::unordered_map<uint64_t, aio_owner> aio_tags;
+    // finished and running requests of submit(), per thread
+    std::unordered_map<std::thread::id, std::deque<disk_aio>> aio_done;
+    std::unordered_map<std::thread::id, unsigned> aio_in_flight;
+    uint64_t next_tag;
+    // finds a block and moves it to the front, loading it from the disk
+    // if load is set, otherwise leaving its data undefined. The shard
+    // must be locked.
+    cache_block *lookup(shard &s, unsigned block_no, bool load);
+    // takes a block for block_no, evicting the least recently used one
+    cache_block *allocate(shard &s, unsigned block_no);
+    int writeback(shard &s, cache_block &cb);
+    int transfer(std::vector<disk_iovec>& iov, bool write);
+    // reaps finished requests from the disk, or waits for the thread that
+    // does. aio_lock must be held.
+    void collect(std::unique_lock<std::mutex>& lock);
+    void install(const disk_aio& done, readahead_run& run);
+    // waits, with the shard of block_no locked by lock, until the block
+    // is not being read ahead
+    void wait_block(shard &s, unsigned block_no, std::unique_lock<std::mutex>& lock);
+    unsigned long sum(unsigned long shard::*counter);
+public:
+    Cache(Disk &disk, unsigned capacity = CACHE_BLOCKS);
+    ~Cache();
+    // reads one block through the cache
+    int read(unsigned block_no, uint8_t *blk);
+    // writes one block into the cache and marks it dirty
+    int write(unsigned block_no, uint8_t *blk);
+    // reads/writes len bytes at offset within one block through the cache
+    int read_range(unsigned block_no, unsigned offset, void *data, unsigned len);
+    int write_range(unsigned block_no, unsigned offset, const void *data, unsigned len);
+    // vectored read/write: blocks that are cached are served from (or
+    // updated in) the cache, the rest go straight between the disk and
+    // the caller's buffers without being cached. Returns the number of
+    // blocks that failed.
+    int readv(std::vector<disk_iovec>& iov);
+    int writev(std::vector<disk_iovec>& iov);
+    // starts asynchronous reads of the blocks that are neither cached nor
+    // already being read, they are added to the cache when they arrive
+    int readahead(const std::vector<unsigned>& block_nos);
+    // asynchronous requests that bypass the cache, see Disk::submit and
+    // Disk::reap. Each thread reaps only the requests it submitted.
+    int submit(const disk_aio& req);
+    int reap(std::vector<disk_aio>& done, unsigned min_done);
+    // copies a block to blk if it is cached and returns 0, -1 if it is
+    // not. Does not load the block or change the LRU order.
+    int peek(unsigned block_no, uint8_t *blk);
+    // pins a cached block. Returns 1 if it was not pinned before, 0 if it
+    // was and -1 if it is not cached.
+    int pin(unsigned block_no);
+    // unpins all blocks and clears their dirty ranges, the blocks stay dirty
+    void unpin_all();
+    // returns the range [*lo, *hi) of a cached block changed since it was
+    // last written back or unpinned, -1 if the block is not cached
+    int dirty_range(unsigned block_no, unsigned *lo, unsigned *hi);
+    // writes all dirty blocks that are not pinned back to the disk
+    int flush();
+    // flush() and sync the disk
+    int sync();
+    unsigned long get_hits() { return sum(&shard::hits); }
+    unsigned long get_misses() { return sum(&shard::misses); }
+    unsigned long get_writebacks() { return sum(&shard::writebacks); }
+    unsigned long get_readaheads() { return sum(&shard::readaheads); }
+};
+
+#endif // __CACHE_H__
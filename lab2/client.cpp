@@ -0,0 +1,225 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs.h"
+#include "protocol.h"
+
+// Client of the file system server (see Server). Runs one command given
+// on the command line:
+//     fsclient <socket> <command> [args]
+// or, without a command, reads shell commands from stdin and runs them
+// in one session, so that cd carries over to the next command. The
+// commands are those of the shell plus
+//     pread <file> <offset> <len>     prints len bytes at offset
+//     pwrite <file> <offset> <data>   writes data at offset
+//     shutdown                        stops the server
+// create takes the content from the following lines up to an empty line.
+
+static int conn = -1;
+
+static int write_all(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t*)data;
+    while (len > 0) {
+        ssize_t n = ::write(conn, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(void *data, size_t len) {
+    uint8_t *p = (uint8_t*)data;
+    while (len > 0) {
+        ssize_t n = ::read(conn, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static std::string number(uint32_t n) {
+    return std::string((const char*)&n, sizeof(n));
+}
+
+// Waits for the next response. Returns its status, or -1 with a message
+// if the server went away.
+static int response(std::string *data) {
+    response_header r;
+    if (read_all(&r, sizeof(r))) {
+        std::cerr << "fsclient: lost the connection to the server\n";
+        return -1;
+    }
+    std::string buf(r.length, '\0');
+    if (r.length > 0 && read_all(&buf[0], r.length)) {
+        std::cerr << "fsclient: lost the connection to the server\n";
+        return -1;
+    }
+    if (data)
+        *data = buf;
+    return r.status;
+}
+
+// Sends a request and waits for its (first) response. Returns the status,
+// or -1 with a message if the server went away.
+static int request(uint8_t op, const std::vector<std::string>& args, std::string *data) {
+    std::string body;
+    for (const auto& a : args) {
+        body += number(a.size());
+        body += a;
+    }
+    if (body.size() > MAX_REQUEST) {
+        std::cerr << "fsclient: request too large\n";
+        return -1;
+    }
+    request_header h = {(uint32_t)body.size(), op, (uint8_t)args.size(), 0};
+    if (write_all(&h, sizeof(h)) || write_all(body.data(), body.size())) {
+        std::cerr << "fsclient: lost the connection to the server\n";
+        return -1;
+    }
+    return response(data);
+}
+
+static void print_ls(const std::string& data) {
+    std::cout << "name\t type\t accessrights\t size\n";
+    for (size_t pos = 0; pos + sizeof(dir_entry) <= data.size(); pos += sizeof(dir_entry)) {
+        dir_entry entry;
+        std::memcpy(&entry, &data[pos], sizeof(entry));
+        std::string name(entry.file_name, strnlen(entry.file_name, sizeof(entry.file_name)));
+        std::string type = (entry.type == TYPE_DIR) ? "dir" : "file";
+        std::string size = (entry.type == TYPE_DIR) ? "-" : std::to_string(entry.size);
+
+        std::string rights = "";
+        rights += (entry.access_rights & READ) ? 'r' : '-';
+        rights += (entry.access_rights & WRITE) ? 'w' : '-';
+        rights += (entry.access_rights & EXECUTE) ? 'x' : '-';
+
+        printf("%-8s %-6s %-11s %s\n", name.c_str(), type.c_str(), rights.c_str(), size.c_str());
+    }
+    fflush(stdout);
+}
+
+// Runs one command. Returns the status of the request, -1 on bad usage.
+static int run(std::vector<std::string>& cmd, std::istream& in) {
+    struct command {
+        const char *name;
+        uint8_t op;
+        unsigned argc;
+        const char *usage;
+    };
+    static const command commands[] = {
+        {"format", OP_FORMAT, 0, ""},
+        {"create", OP_CREATE, 1, " <file>"},
+        {"cat", OP_CAT, 1, " <file>"},
+        {"ls", OP_LS, 0, ""},
+        {"cp", OP_CP, 2, " <sourcefile> <destfile>"},
+        {"mv", OP_MV, 2, " <sourcefile> <destfile>"},
+        {"rm", OP_RM, 1, " <file>"},
+        {"append", OP_APPEND, 2, " <file1> <file2>"},
+        {"mkdir", OP_MKDIR, 1, " <dirpath>"},
+        {"cd", OP_CD, 1, " <dirpath>"},
+        {"pwd", OP_PWD, 0, ""},
+        {"chmod", OP_CHMOD, 2, " <accessrights> <file>"},
+        {"sync", OP_SYNC, 0, ""},
+        {"pread", OP_PREAD, 3, " <file> <offset> <len>"},
+        {"pwrite", OP_PWRITE, 3, " <file> <offset> <data>"},
+        {"shutdown", OP_SHUTDOWN, 0, ""},
+    };
+    for (const auto& c : commands) {
+        if (cmd[0] != c.name)
+            continue;
+        if (cmd.size() != c.argc + 1) {
+            std::cout << "Usage: " << c.name << c.usage << "\n";
+            return -1;
+        }
+        std::vector<std::string> args(cmd.begin() + 1, cmd.end());
+        if (c.op == OP_CREATE) {
+            // content up to the first empty line, as in the shell
+            std::string line, content;
+            while (std::getline(in, line) && !line.empty())
+                content += line + "\n";
+            args.push_back(content);
+        }
+        if (c.op == OP_PREAD || c.op == OP_PWRITE) {
+            try {
+                args[1] = number(std::stoul(args[1]));
+                if (c.op == OP_PREAD)
+                    args[2] = number(std::stoul(args[2]));
+            } catch (const std::exception& e) {
+                std::cout << "Usage: " << c.name << c.usage << "\n";
+                return -1;
+            }
+        }
+        std::string data;
+        int status = request(c.op, args, &data);
+        // a cat comes in parts, each printed as it arrives
+        while (c.op == OP_CAT && status == 1) {
+            std::cout << data;
+            status = response(&data);
+        }
+        if (status < 0) {
+            std::cout << "Error: " << c.name << " failed, error code " << status << std::endl;
+            return status;
+        }
+        if (c.op == OP_LS)
+            print_ls(data);
+        else if (c.op == OP_PWD)
+            std::cout << data << std::endl;
+        else
+            std::cout << data << std::flush;
+        return status;
+    }
+    std::cout << "Unknown command: " << cmd[0] << "\n";
+    return -1;
+}
+
+static std::vector<std::string> split(const std::string& line) {
+    std::vector<std::string> words;
+    std::stringstream stream(line);
+    std::string word;
+    while (stream >> word)
+        words.push_back(word);
+    return words;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: fsclient <socket> [command [args]]\n";
+        return 1;
+    }
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0 || connect(conn, (sockaddr*)&addr, sizeof(addr))) {
+        std::cerr << "fsclient: can't connect to " << argv[1] << "\n";
+        return 1;
+    }
+
+    int ret_val = 0;
+    if (argc > 2) {
+        std::vector<std::string> cmd(argv + 2, argv + argc);
+        ret_val = run(cmd, std::cin);
+    } else {
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            std::vector<std::string> cmd = split(line);
+            if (cmd.empty())
+                continue;
+            if (cmd[0] == "quit")
+                break;
+            ret_val = run(cmd, std::cin);
+        }
+    }
+    close(conn);
+    return ret_val < 0 ? 1 : 0;
+}
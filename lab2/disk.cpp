@@ -1,29 +1,71 @@
 #include <iostream>
 #include "disk.h"
 #include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <climits>
+#include <cerrno>
 
 
-Disk::Disk()
+Disk::Disk(const std::string& name, unsigned no_blocks)
 {
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    if (!disk_file_exists(name)) {
         std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
-        f.write("", 1);
+        std::cout << "Creating disk file: " << name << std::endl;
     }
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+    fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
         exit(-1);
     }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        std::cerr << "ERROR: Can't stat diskfile: " << name << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    if (no_blocks == 0)
+        no_blocks = st.st_size >= BLOCK_SIZE ? st.st_size / BLOCK_SIZE : DISK_BLOCKS;
+    this->no_blocks = no_blocks;
+    disk_size = (uint64_t)BLOCK_SIZE * no_blocks;
+    // the file is sparse, blocks that were never written take no space. A
+    // larger file is left as it is, only its first no_blocks are used.
+    if ((uint64_t)st.st_size < disk_size && ftruncate(fd, disk_size) < 0) {
+        std::cerr << "ERROR: Can't resize diskfile: " << name << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    aio_in_flight = 0;
+    aio_stop = false;
+    blocks_read = 0;
+    blocks_written = 0;
+    map = nullptr;
+    if (USE_MMAP) {
+        void *p = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+            map = (uint8_t*)p;
+        else
+            std::cerr << "Disk - WARNING: mmap failed, using pread/pwrite\n";
+    }
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    {
+        std::lock_guard<std::mutex> lock(aio_lock);
+        aio_stop = true;
+    }
+    aio_queued.notify_all();
+    for (auto &t : workers)
+        t.join();
+    if (map)
+        munmap(map, disk_size);
+    close(fd);
 }
 
 bool
@@ -41,10 +83,15 @@ int Disk::write(unsigned block_no, uint8_t *blk) {
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    stats_timer timer(stats[DISK_WRITE], BLOCK_SIZE);
+    count(1, true);
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (map) {
+        std::memcpy(map + offset, blk, BLOCK_SIZE);
+        return 0;
+    }
+    if (pwrite(fd, blk, BLOCK_SIZE, offset) != BLOCK_SIZE)
+        return -1;
     return 0;
 }
 
@@ -56,8 +103,207 @@ int Disk::read(unsigned block_no, uint8_t *blk) {
         std::cout << "Disk::read - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    stats_timer timer(stats[DISK_READ], BLOCK_SIZE);
+    count(1, false);
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (map) {
+        std::memcpy(blk, map + offset, BLOCK_SIZE);
+        return 0;
+    }
+    if (pread(fd, blk, BLOCK_SIZE, offset) != BLOCK_SIZE)
+        return -1;
+    return 0;
+}
+
+int Disk::readv(std::vector<disk_iovec>& iov) {
+    stats_timer timer(stats[DISK_READV], (uint64_t)iov.size() * BLOCK_SIZE);
+    return transfer(iov, false);
+}
+
+int Disk::writev(std::vector<disk_iovec>& iov) {
+    stats_timer timer(stats[DISK_WRITEV], (uint64_t)iov.size() * BLOCK_SIZE);
+    return transfer(iov, true);
+}
+
+// splits the request into runs of consecutive blocks and moves each run
+// with one system call (or one pass over the mapping)
+int Disk::transfer(std::vector<disk_iovec>& iov, bool write) {
+    int failed = 0;
+    size_t i = 0;
+    while (i < iov.size()) {
+        if (DEBUG)
+            std::cout << "Disk::" << (write ? "writev(" : "readv(") << iov[i].block_no << ")\n";
+        if (iov[i].block_no >= no_blocks) {
+            std::cout << "Disk::" << (write ? "writev" : "readv")
+                      << " - ERROR: Invalid block number (" << iov[i].block_no << ")\n";
+            iov[i++].status = -1;
+            failed++;
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < iov.size() && run < IOV_MAX &&
+               iov[i + run].block_no == iov[i].block_no + run &&
+               iov[i + run].block_no < no_blocks)
+            run++;
+
+        count(run, write);
+        off_t offset = (off_t)iov[i].block_no * BLOCK_SIZE;
+        int status = 0;
+        if (map) {
+            for (size_t j = 0; j < run; j++) {
+                if (write)
+                    std::memcpy(map + offset + j * BLOCK_SIZE, iov[i + j].blk, BLOCK_SIZE);
+                else
+                    std::memcpy(iov[i + j].blk, map + offset + j * BLOCK_SIZE, BLOCK_SIZE);
+            }
+        } else {
+            struct iovec vec[IOV_MAX];
+            for (size_t j = 0; j < run; j++) {
+                vec[j].iov_base = iov[i + j].blk;
+                vec[j].iov_len = BLOCK_SIZE;
+            }
+            ssize_t n = write ? pwritev(fd, vec, run, offset) : preadv(fd, vec, run, offset);
+            if (n != (ssize_t)(run * BLOCK_SIZE))
+                status = -1;
+        }
+        for (size_t j = 0; j < run; j++)
+            iov[i + j].status = status;
+        if (status)
+            failed += run;
+        i += run;
+    }
+    return failed;
+}
+
+uint8_t *Disk::block_ptr(unsigned block_no) {
+    if (!map || block_no >= no_blocks)
+        return nullptr;
+    return map + (size_t)block_no * BLOCK_SIZE;
+}
+
+int Disk::send_to_fd(int out_fd, unsigned block_no, uint64_t len) {
+    if (DEBUG)
+        std::cout << "Disk::send_to_fd(" << block_no << ", " << len << ")\n";
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (block_no >= no_blocks || (uint64_t)offset + len > disk_size) {
+        std::cout << "Disk::send_to_fd - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    stats_timer timer(stats[DISK_SEND], len);
+    count((len + BLOCK_SIZE - 1) / BLOCK_SIZE, false);
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, fd, &offset, len);
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if (n <= 0)
+            return -1;
+        len -= n;
+    }
+    // sendfile can't write to this kind of fd, copy through a buffer
+    uint8_t buf[BLOCK_SIZE];
+    while (len > 0) {
+        size_t chunk = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+        const uint8_t *data = map ? map + offset : buf;
+        if (!map && pread(fd, buf, chunk, offset) != (ssize_t)chunk)
+            return -1;
+        ssize_t n = ::write(out_fd, data, chunk);
+        if (n <= 0)
+            return -1;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// moves count blocks between one buffer and the disk
+int Disk::transfer_run(unsigned block_no, unsigned count, uint8_t *buf, bool write) {
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    this->count(count, write);
+    stats_timer timer(stats[write ? DISK_AIO_WRITE : DISK_AIO_READ], len);
+    if (map) {
+        if (write)
+            std::memcpy(map + offset, buf, len);
+        else
+            std::memcpy(buf, map + offset, len);
+        return 0;
+    }
+    while (len > 0) {
+        ssize_t n = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int Disk::submit(const disk_aio& req) {
+    if (DEBUG)
+        std::cout << "Disk::submit(" << req.block_no << ", " << req.count << ")\n";
+    if (req.count == 0 || req.block_no >= no_blocks || req.count > no_blocks - req.block_no) {
+        std::cout << "Disk::submit - ERROR: Invalid block number (" << req.block_no << ")\n";
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(aio_lock);
+    if (workers.empty()) {
+        for (int i = 0; i < AIO_THREADS; i++)
+            workers.emplace_back(&Disk::aio_worker, this);
+    }
+    aio_queue.push_back(req);
+    aio_in_flight++;
+    aio_queued.notify_one();
     return 0;
 }
+
+int Disk::reap(std::vector<disk_aio>& done, unsigned min_done) {
+    std::unique_lock<std::mutex> lock(aio_lock);
+    if (min_done > aio_in_flight)
+        min_done = aio_in_flight;
+    aio_completed.wait(lock, [&] { return aio_done.size() >= min_done; });
+    int n = aio_done.size();
+    done.insert(done.end(), aio_done.begin(), aio_done.end());
+    aio_done.clear();
+    aio_in_flight -= n;
+    return n;
+}
+
+void Disk::aio_worker() {
+    std::unique_lock<std::mutex> lock(aio_lock);
+    while (true) {
+        aio_queued.wait(lock, [&] { return aio_stop || !aio_queue.empty(); });
+        if (aio_queue.empty())
+            return;
+        disk_aio req = aio_queue.front();
+        aio_queue.pop_front();
+        lock.unlock();
+        req.status = transfer_run(req.block_no, req.count, req.buf, req.write);
+        lock.lock();
+        aio_done.push_back(req);
+        aio_completed.notify_all();
+    }
+}
+
+// msync the mapping (or fsync the file) so that everything written so far
+// survives a crash
+int Disk::sync() {
+    stats_timer timer(stats[DISK_SYNC]);
+    if (DEBUG)
+        std::cout << "Disk::sync()\n";
+    if (map)
+        return msync(map, disk_size, MS_SYNC);
+    return fsync(fd);
+}
+
+const char *Disk::call_name(int call) {
+    static const char *names[DISK_CALLS] = {
+        "read", "write", "readv", "writev", "send_to_fd", "aio_read", "aio_write", "sync"
+    };
+    return names[call];
+}
+
+void Disk::reset_stats() {
+    for (auto &s : stats)
+        s.reset();
+}
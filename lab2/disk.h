@@ -1,6 +1,13 @@
 #include <iostream>
 #include <fstream>
 #include <cstdint>
+#include <vector>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "stats.h"
 
 
 #ifndef __DISK_H__
@@ -8,23 +15,106 @@
 
 #define DISKNAME "diskfile.bin"
 #define BLOCK_SIZE 4096
+// number of blocks of a new disk file, 8 MiB
+#define DISK_BLOCKS 2048
 #define DEBUG false
+// map the disk file into memory; set to false to use pread/pwrite instead
+#define USE_MMAP true
+// worker threads serving asynchronous requests
+#define AIO_THREADS 4
+
+// calls of the Disk counted in its stats
+#define DISK_READ 0
+#define DISK_WRITE 1
+#define DISK_READV 2
+#define DISK_WRITEV 3
+#define DISK_SEND 4
+#define DISK_AIO_READ 5     // asynchronous requests, as served by a worker
+#define DISK_AIO_WRITE 6
+#define DISK_SYNC 7
+#define DISK_CALLS 8
+
+// one block of a vectored read/write request
+struct disk_iovec {
+    unsigned block_no;
+    uint8_t *blk;
+    int status;     // set by readv/writev: 0 on success, -1 on error
+};
+
+// an asynchronous request for count consecutive blocks from block_no
+struct disk_aio {
+    unsigned block_no;
+    unsigned count;
+    uint8_t *buf;
+    bool write;
+    uint64_t tag;   // chosen by the caller, handed back on completion
+    int status;     // set on completion: 0 on success, -1 on error
+};
 
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    int fd;         // file descriptor of the disk file
+    uint8_t *map;   // the mapped disk file, nullptr when not mapped
+    unsigned no_blocks;
+    uint64_t disk_size;
     bool disk_file_exists (const std::string& name);
+    int transfer(std::vector<disk_iovec>& iov, bool write);
+    int transfer_run(unsigned block_no, unsigned count, uint8_t *buf, bool write);
+    // asynchronous requests are served by a pool of worker threads that
+    // is started on the first submit()
+    std::vector<std::thread> workers;
+    std::mutex aio_lock;
+    std::condition_variable aio_queued;
+    std::condition_variable aio_completed;
+    std::deque<disk_aio> aio_queue;
+    std::deque<disk_aio> aio_done;
+    unsigned aio_in_flight;     // submitted and not reaped yet
+    bool aio_stop;
+    void aio_worker();
+    // blocks moved from and to the disk file
+    std::atomic<unsigned long> blocks_read;
+    std::atomic<unsigned long> blocks_written;
+    void count(unsigned long blocks, bool write) { (write ? blocks_written : blocks_read) += blocks; }
+    op_stats stats[DISK_CALLS];
 public:
-    Disk();
+    // opens (or creates) the disk file name with no_blocks blocks. With
+    // no_blocks 0 an existing file keeps its size and a new file gets
+    // DISK_BLOCKS blocks. A file is grown to no_blocks but never cut.
+    Disk(const std::string& name = DISKNAME, unsigned no_blocks = 0);
     ~Disk();
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // reads/writes a list of blocks. Entries with consecutive block numbers
+    // are transferred with a single preadv/pwritev call. Returns the number
+    // of blocks that failed, each entry's status tells which.
+    int readv(std::vector<disk_iovec>& iov);
+    int writev(std::vector<disk_iovec>& iov);
+    // returns a pointer to a block in the mapped disk file, or nullptr if
+    // the disk is not mapped. Writes through the pointer must be followed
+    // by a sync() to be durable.
+    uint8_t *block_ptr(unsigned block_no);
+    // writes len bytes from the start of block_no on to the file
+    // descriptor out_fd, without copying them through user space
+    int send_to_fd(int out_fd, unsigned block_no, uint64_t len);
+    // durability point: flushes all written blocks to the disk file
+    int sync();
+    // queues an asynchronous read or write, returns -1 if the request is
+    // not valid. The buffer must stay valid until the request is reaped.
+    int submit(const disk_aio& req);
+    // moves finished requests to done, waiting until at least min_done
+    // have finished. Returns the number of requests moved.
+    int reap(std::vector<disk_aio>& done, unsigned min_done);
+    // blocks read from and written to the disk file since it was opened
+    unsigned long get_blocks_read() { return blocks_read; }
+    unsigned long get_blocks_written() { return blocks_written; }
+    // calls, bytes and latencies of each kind of call, see DISK_READ...
+    const op_stats& get_stats(int call) { return stats[call]; }
+    static const char *call_name(int call);
+    void reset_stats();
 };
 
 #endif // __DISK_H__
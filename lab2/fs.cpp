@@ -3,619 +3,1662 @@
 #include <algorithm>
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <unistd.h>
+#include <atomic>
 #include "fs.h"
 
-FS::FS() {
-    disk.read(FAT_BLOCK, (uint8_t *)fat); // Load the FAT table from the disk
-    current_dir_block = ROOT_BLOCK;
-    current_path = "/";
-
+// every mount and format gets a new id, which starts all sessions over
+static std::atomic<unsigned> mounts(0);
+static thread_local std::unordered_map<unsigned, fs_session> sessions;
+
+FS::FS(const std::string& diskname, unsigned no_blocks, unsigned cache_blocks)
+    : disk(diskname, no_blocks), cache(disk, cache_blocks), journal(disk, cache) {
+    // Mount: the superblock tells where the FAT and the root directory are
+    cache.read_range(SUPER_BLOCK, 0, &sb, sizeof(sb));
+    if (sb.magic != FS_MAGIC || sb.version != FS_VERSION || sb.block_size != BLOCK_SIZE ||
+        sb.no_blocks != disk.get_no_blocks()) {
+        std::cerr << "No file system found on the disk, run format\n";
+        // until then use the layout format would create
+        initSuper();
+        free_map.assign((sb.no_blocks + 63) / 64, 0);
+        free_hint = 0;
+        run_miss = 0;
+    } else {
+        // Finish the transactions committed before a crash
+        journal.init(sb.journal_start, sb.journal_blocks);
+        journal.replay();
+        buildFreeMap();
+    }
+    mount_id = ++mounts;
+    cwd = std::make_shared<cwd_table>();
+    path_gen = 0;
+    files.assign(MAX_OPEN_FILES, open_file());
 }
 
 FS::~FS() {
-    // Save the FAT back to the disk when the program exits
-    disk.write(FAT_BLOCK, (uint8_t *)fat);
+    // Write everything home so the next mount has nothing to replay
+    journal.checkpoint();
 }
 
-// Formats the disk
-int FS::format() {
-    // Initialize FAT
-     fat[0] = FAT_EOF;  // Root directory block
-    fat[1] = FAT_EOF;  // FAT block
-    std::fill(fat + 2, fat + (BLOCK_SIZE / 2), FAT_FREE);
+// Commits the running transaction and writes all dirty cached blocks
+// back to the disk
+int FS::sync() {
+    stats_timer timer(counters[FS_SYNC]);
+    shared_guard ns(ns_lock);
+    if (journal.commit()) return -1;
+    return cache.sync();
+}
 
-    // Initialize root directory block
-    uint8_t root_block[BLOCK_SIZE] = {0};
-    dir_entry* root_entries = (dir_entry*)root_block;
+void FS::set_commit_group(unsigned ops, unsigned delay_ms) {
+    journal.set_group(ops, delay_ms);
+}
 
-    // Set up ".." entry in root directory
-    strcpy(root_entries[0].file_name, "..");
-    root_entries[0].first_blk = ROOT_BLOCK;  // Points to itself
-    root_entries[0].type = TYPE_DIR;
-    root_entries[0].access_rights = READ | WRITE | EXECUTE;
-    root_entries[0].parent_blk = ROOT_BLOCK;  // Root is its own parent
-    root_entries[0].size = 0;
+void FS::get_commit_group(unsigned* ops, unsigned* delay_ms) {
+    journal.get_group(ops, delay_ms);
+}
 
-    // Write blocks
-    disk.write(ROOT_BLOCK, root_block);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+// Fills in the superblock for the geometry of the disk: the FAT starts at
+// block 1, one 32-bit entry per block, followed by a reference count table
+// of the same size, the journal and the root directory
+void FS::initSuper() {
+    sb.magic = FS_MAGIC;
+    sb.version = FS_VERSION;
+    sb.block_size = BLOCK_SIZE;
+    sb.no_blocks = disk.get_no_blocks();
+    sb.fat_blocks = (sb.no_blocks + FAT_PER_BLOCK - 1) / FAT_PER_BLOCK;
+    sb.ref_start = FAT_START + sb.fat_blocks;
+    sb.journal_start = sb.ref_start + sb.fat_blocks;
+    sb.journal_blocks = std::min(std::max(sb.no_blocks / 32, (uint32_t)JOURNAL_MIN), (uint32_t)JOURNAL_MAX);
+    sb.root_blk = sb.journal_start + sb.journal_blocks;
+}
 
-    // Set initial state
-    current_dir_block = ROOT_BLOCK;
-    current_path = "/";
+void cwd_ref::acquire() {
+    if (!table) return;
+    std::lock_guard<std::mutex> lock(table->lock);
+    table->refs[dir]++;
+}
 
-    return 0;
+void cwd_ref::release() {
+    if (!table) return;
+    std::lock_guard<std::mutex> lock(table->lock);
+    auto it = table->refs.find(dir);
+    if (--it->second == 0)
+        table->refs.erase(it);
 }
-// Creates a new file
-int FS::create(std::string filepath) {
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
-    // Find free entry after ".."
-    int free_entry = -1;
-    for (int i = 1; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk == 0) {
-            free_entry = i;
-            break;
-        }
-        if (filepath == entries[i].file_name) return -1;
+
+cwd_ref& cwd_ref::operator=(const cwd_ref& o) {
+    if (this != &o) {
+        release();
+        table = o.table;
+        dir = o.dir;
+        acquire();
     }
-    if (free_entry == -1) return -1;
+    return *this;
+}
 
-    std::string content;
-    std::string line;
-    while (std::getline(std::cin, line) && !line.empty()) {
-        content += line + '\n';
+// Returns the working directory of the calling thread, the root directory
+// for a thread that has not used cd since the last mount or format
+fs_session& FS::self() {
+    auto it = sessions.find(mount_id);
+    if (it == sessions.end()) {
+        fs_session root = {sb.root_blk, "/", mount_id, path_gen, cwd_ref(cwd, sb.root_blk)};
+        it = sessions.emplace(mount_id, root).first;
     }
+    return it->second;
+}
 
-    // Find free blocks
-    int first_block = -1;
-    int current_block = -1;
-    int blocks_needed = (content.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int blocks_found = 0;
+// Returns the path of the working directory of session, found again
+// from the directory if one was moved since
+const std::string& FS::sessionPath(fs_session& session) {
+    if (session.path_gen != path_gen) {
+        session.path = pathOf(session.dir_block);
+        session.path_gen = path_gen;
+    }
+    return session.path;
+}
 
-    for (int i = 2; i < BLOCK_SIZE/2 && blocks_found < blocks_needed; i++) {
-        if (fat[i] == FAT_FREE) {
-            if (first_block == -1) first_block = i;
-            else fat[current_block] = i;
-            current_block = i;
-            blocks_found++;
+// Returns the path of a directory, following the ".." entries up to the
+// root and finding each directory's name in its parent
+std::string FS::pathOf(uint32_t dir_block) {
+    std::string path;
+    while (dir_block != sb.root_blk) {
+        uint32_t parent = parentOf(dir_block);
+        if (parent == dir_block) break;
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(stripeOf(parent).lock);
+            for (const auto& n : dirInfo(parent).names) {
+                dir_entry entry;
+                readEntry(n.second, &entry);
+                if (entry.first_blk == dir_block) {
+                    name = n.first;
+                    break;
+                }
+            }
         }
+        path = "/" + name + path;
+        dir_block = parent;
     }
-    if (blocks_found < blocks_needed) return -1;
+    return path.empty() ? "/" : path;
+}
+
+fs_session FS::get_session() {
+    shared_guard ns(ns_lock);
+    fs_session& session = self();
+    sessionPath(session);
+    return session;
+}
 
-    fat[current_block] = FAT_EOF;
+// A session saved before the last format starts over in the root directory
+void FS::set_session(const fs_session& session) {
+    shared_guard ns(ns_lock);
+    if (session.mount == mount_id)
+        self() = session;
+    else
+        self() = fs_session{sb.root_blk, "/", mount_id, path_gen, cwd_ref(cwd, sb.root_blk)};
+}
 
-    // Write content
-    current_block = first_block;
-    for (size_t pos = 0; pos < content.size(); pos += BLOCK_SIZE) {
-        uint8_t block[BLOCK_SIZE] = {0};
-        size_t chunk_size = std::min(static_cast<size_t>(BLOCK_SIZE), content.size() - pos);
-        std::memcpy(block, content.c_str() + pos, chunk_size);
-        disk.write(current_block, block);
-        current_block = fat[current_block];
-    }
+rw_lock& FS::dirLock(uint32_t dir_block) {
+    return dir_locks[dir_block % DIR_LOCK_STRIPES];
+}
 
-    // Update directory preserving ".."
-    strcpy(entries[free_entry].file_name, filepath.c_str());
-    entries[free_entry].size = content.size();
-    entries[free_entry].first_blk = first_block;
-    entries[free_entry].type = TYPE_FILE;
-    entries[free_entry].access_rights = READ | WRITE;
-    entries[free_entry].parent_blk = current_dir_block;
+// FAT entries are read and written in place in the cached FAT blocks, so
+// only the parts of the FAT in use have to be in memory
+int FS::getFat(uint32_t block) {
+    int32_t entry;
+    if (cache.read_range(FAT_START + block / FAT_PER_BLOCK, (block % FAT_PER_BLOCK) * sizeof(entry),
+                         &entry, sizeof(entry)))
+        return FAT_EOF;
+    return entry;
+}
 
-    disk.write(current_dir_block, dir_block);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+void FS::setFat(uint32_t block, int value) {
+    int32_t entry = value;
+    cache.write_range(FAT_START + block / FAT_PER_BLOCK, (block % FAT_PER_BLOCK) * sizeof(entry),
+                      &entry, sizeof(entry));
+    journal.add(FAT_START + block / FAT_PER_BLOCK);
+}
 
-    return 0;
+int FS::getRef(uint32_t block) {
+    int32_t entry;
+    if (cache.read_range(sb.ref_start + block / FAT_PER_BLOCK, (block % FAT_PER_BLOCK) * sizeof(entry),
+                         &entry, sizeof(entry)))
+        return 0;
+    return entry;
 }
-int FS::cat(std::string filepath) {
-    // Load the current directory
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
-    // Check if filepath is a directory
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 &&
-            filepath == entries[i].file_name &&
-            entries[i].type == TYPE_DIR) {
-            std::cerr << "Error: Cannot cat a directory\n";
-            return -1;
+
+void FS::setRef(uint32_t block, int value) {
+    int32_t entry = value;
+    cache.write_range(sb.ref_start + block / FAT_PER_BLOCK, (block % FAT_PER_BLOCK) * sizeof(entry),
+                      &entry, sizeof(entry));
+    journal.add(sb.ref_start + block / FAT_PER_BLOCK);
+}
+
+// Rebuilds the free-space bitmap from the FAT, reading it IO_BATCH blocks
+// at a time past the cache
+void FS::buildFreeMap() {
+    free_map.assign((sb.no_blocks + 63) / 64, 0);
+    std::vector<uint8_t> buf(IO_BATCH * BLOCK_SIZE);
+    std::vector<disk_iovec> iov;
+    for (uint32_t first = 0; first < sb.fat_blocks; first += IO_BATCH) {
+        iov.clear();
+        for (uint32_t i = first; i < sb.fat_blocks && i < first + IO_BATCH; i++)
+            iov.push_back({FAT_START + i, &buf[(i - first) * BLOCK_SIZE], 0});
+        cache.readv(iov);
+
+        int32_t* entries = (int32_t*)buf.data();
+        uint32_t base = first * FAT_PER_BLOCK;
+        uint32_t end = std::min(sb.no_blocks, base + (uint32_t)iov.size() * FAT_PER_BLOCK);
+        for (uint32_t b = base; b < end; b++) {
+            if (entries[b - base] == FAT_FREE)
+                free_map[b / 64] |= 1ULL << (b % 64);
         }
     }
-    // Find the file
-    int first_block = -1;
-    uint32_t file_size = 0;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 &&
-            filepath == entries[i].file_name &&
-            entries[i].type == TYPE_FILE) {
-            first_block = entries[i].first_blk;
-            file_size = entries[i].size;
-            break;
-        }
+    free_hint = 0;
+    run_miss = 0;
+    pending_free.clear();
+}
+
+// Moves the blocks freed by committed transactions into the free map
+void FS::releaseFreed() {
+    while (!pending_free.empty() && journal.committed(pending_free.front().first)) {
+        int block = pending_free.front().second;
+        free_map[block / 64] |= 1ULL << (block % 64);
+        pending_free.pop_front();
+        run_miss = 0;
     }
+}
 
-    if (first_block == -1) {
-        std::cerr << "Error: File not found\n";
-        return -1;
+// Takes the next free block (next-fit from the last allocation) and marks
+// it as the end of a chain. Returns -1 if the disk is full.
+int FS::allocBlock() {
+    std::lock_guard<std::recursive_mutex> lock(alloc_lock);
+    releaseFreed();
+    unsigned words = free_map.size();
+    for (unsigned n = 0; n < words; n++) {
+        unsigned w = (free_hint + n) % words;
+        if (free_map[w]) {
+            int block = w * 64 + __builtin_ctzll(free_map[w]);
+            free_map[w] &= ~(1ULL << (block % 64));
+            setFat(block, FAT_EOF);
+            free_hint = w;
+            return block;
+        }
     }
+    return -1;
+}
 
-    // Read and print file contentsh
-    int current_block = first_block;
-    uint32_t bytes_read = 0;
-    while (current_block != FAT_EOF && bytes_read < file_size) {
-        uint8_t block[BLOCK_SIZE];
-        disk.read(current_block, block);
+void FS::freeBlock(int block) {
+    std::lock_guard<std::recursive_mutex> lock(alloc_lock);
+    setFat(block, FAT_FREE);
+    pending_free.push_back({journal.current_tx(), block});
+}
 
-        uint32_t bytes_to_print = std::min(static_cast<uint32_t>(BLOCK_SIZE), file_size - bytes_read);
-        for (uint32_t i = 0; i < bytes_to_print; i++) {
-            std::cout << block[i];
-        }
+// Frees every block of the chain starting at block
+void FS::freeChain(int block) {
+    std::lock_guard<std::recursive_mutex> lock(alloc_lock);
+    while (block != FAT_EOF) {
+        int next = getFat(block);
+        freeBlock(block);
+        block = next;
+    }
+}
 
-        bytes_read += bytes_to_print;
-        current_block = fat[current_block];
+// Drops one reference to the chain starting at block. Blocks are freed
+// up to the first one that is still referenced from another chain.
+void FS::releaseChain(int block) {
+    while (block != FAT_EOF) {
+        int refs = getRef(block);
+        if (refs > 0) {
+            setRef(block, refs - 1);
+            return;
+        }
+        int next = getFat(block);
+        freeBlock(block);
+        block = next;
     }
+}
 
+// Makes the chain of entry private to it before it is written: the part
+// from the first shared block on is copied and the entry (or the block
+// before) is linked to the copy. Writes the entry if it changes.
+int FS::unshare(dir_entry& entry, const dir_slot& where) {
+    // copies of the same file can be written in different directories
+    std::lock_guard<std::mutex> lock(cow_lock);
+    int prev = -1;
+    int block = entry.first_blk;
+    while (block != FAT_EOF && getRef(block) == 0) {
+        prev = block;
+        block = getFat(block);
+    }
+    if (block == FAT_EOF) return 0;
+
+    int copy = copyChain(block);
+    if (copy == -1) return -1;
+    setRef(block, getRef(block) - 1);
+    if (prev == -1) {
+        // the old chain stays as it was for the other copies
+        entry.first_blk = copy;
+        writeEntry(where, entry);
+        forgetChain(copy);
+    } else {
+        setFat(prev, copy);
+        forgetChain(entry.first_blk);
+    }
     return 0;
 }
-// Lists the files in the current directory
-// Update ls() to show file types
-int FS::ls() {
-    std::cout << "name\t type\t accessrights\t size\n";
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0) {
-            std::string name = entries[i].file_name;
-            std::string type = (entries[i].type == TYPE_DIR) ? "dir" : "file";
-            std::string size = (entries[i].type == TYPE_DIR) ? "-" : std::to_string(entries[i].size);
-
-            // Format access rights
-            std::string rights = "";
-            rights += (entries[i].access_rights & READ) ? 'r' : '-';
-            rights += (entries[i].access_rights & WRITE) ? 'w' : '-';
-            rights += (entries[i].access_rights & EXECUTE) ? 'x' : '-';
-
-            printf("%-8s %-6s %-11s %s\n", name.c_str(), type.c_str(), rights.c_str(), size.c_str());
+
+// Finds count consecutive free blocks, searching next-fit from the last
+// allocation a whole word of the free map at a time. Returns the first
+// block of the run or -1.
+int FS::findRun(int count) {
+    std::lock_guard<std::recursive_mutex> lock(alloc_lock);
+    releaseFreed();
+    // nothing was freed since a search for a run this long failed
+    if (run_miss && count >= run_miss)
+        return -1;
+    unsigned words = free_map.size();
+    // two passes: from the hint to the end, then from the start to the
+    // words a run ending past the hint can reach
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned w = (pass == 0) ? free_hint : 0;
+        unsigned end = (pass == 0) ? words : std::min(words, free_hint + (count + 63) / 64 + 1);
+        int run = 0;        // free blocks up to the end of the previous word
+        for (; w < end; w++) {
+            uint64_t word = free_map[w];
+            if (word == ~0ULL) {
+                run += 64;
+                if (run >= count)
+                    return (w + 1) * 64 - run;
+                continue;
+            }
+            // the free blocks at the bottom of the word continue the run
+            int low = __builtin_ctzll(~word);
+            if (run + low >= count)
+                return w * 64 - run;
+            // a run inside the word: bit i of m stays set while blocks i
+            // to i + n - 1 are all free
+            if (count <= 64 && word) {
+                uint64_t m = word;
+                for (int n = 1; n < count && m; ) {
+                    int shift = std::min(n, count - n);
+                    m &= m >> shift;
+                    n += shift;
+                }
+                if (m)
+                    return w * 64 + __builtin_ctzll(m);
+            }
+            // the free blocks at the top of the word start the next run
+            run = __builtin_clzll(~word);
         }
     }
-    return 0;
-}// cp <sourcepath> <destpath> makes an exact copy of the file
-// <sourcepath> to a new file <destpath>
-int FS::mv(std::string sourcepath, std::string destpath) {
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
-    // Find source file
+    run_miss = run_miss ? std::min(run_miss, count) : count;
+    return -1;
+}
 
-    // if the destination is starts with / go to the root and find the directory and copy the file to that directory
-    std::string destpathfixed = cleanPath(destpath);
-    dir_entry* src_entry = nullptr;
-    int src_index = -1;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 && sourcepath == entries[i].file_name) {
-            src_entry = &entries[i];
-            src_index = i;
-            break;
+// Allocates a chain of count blocks, as one contiguous run if there is a
+// free run that long, otherwise from whatever blocks are free.
+// Returns its first block, or -1 (with nothing allocated) if there is not
+// enough free space.
+int FS::allocChain(int count) {
+    std::lock_guard<std::recursive_mutex> lock(alloc_lock);
+    int run = count > 1 ? findRun(count) : -1;
+    if (run != -1) {
+        for (int b = run; b < run + count; b++) {
+            free_map[b / 64] &= ~(1ULL << (b % 64));
+            setFat(b, (b + 1 < run + count) ? b + 1 : FAT_EOF);
         }
+        free_hint = (run + count - 1) / 64;
+        return run;
     }
-    if (!src_entry) return -1;
-
-    // Handle parent directory (..)
-    if (destpath == "..") {
-        uint16_t parent_block = entries[0].parent_blk;
-        dir_entry parent_dir;
-        parent_dir.first_blk = parent_block;
-        parent_dir.type = TYPE_DIR;
-        int result = copyToDirectory(src_entry, &parent_dir);
-        if (result == 0) {
-            entries[src_index].first_blk = 0;
-            disk.write(current_dir_block, dir_block);
-        }
-        return result;
-    }
-      dir_entry* dest_dir = nullptr;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 &&
-            destpathfixed == entries[i].file_name &&
-            entries[i].type == TYPE_DIR) {
-            dest_dir = &entries[i];
-            break;
+
+    int first = -1;
+    int prev = -1;
+    for (int i = 0; i < count; i++) {
+        int block = allocBlock();
+        if (block == -1) {
+            freeChain(first);
+            return -1;
         }
+        if (first == -1) first = block;
+        else setFat(prev, block);
+        prev = block;
     }
-    if (dest_dir) {
-        int result = copyToDirectory(src_entry, dest_dir);
-        if (result == 0) {
-            entries[src_index].first_blk = 0;
-            disk.write(current_dir_block, dir_block);
-        }
-        return result;
-    } else {
-        // Simple rename/move
-        for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-            if (entries[i].first_blk != 0 && destpath == entries[i].file_name) {
-                return -1;  // Destination exists
-            }
+    return first;
+}
+
+// Returns the index of a directory, building it from the directory's
+// blocks the first time the directory is used. The stripe of the
+// directory must be locked, or ns_lock held exclusively.
+FS::dir_info& FS::dirInfo(uint32_t dir_block) {
+    std::unordered_map<uint32_t, dir_info>& dir_index = stripeOf(dir_block).dir_index;
+    auto it = dir_index.find(dir_block);
+    if (it != dir_index.end()) return it->second;
+
+    dir_info& info = dir_index[dir_block];
+    uint8_t block[BLOCK_SIZE];
+    for (uint32_t b = dir_block; b != (uint32_t)FAT_EOF; b = getFat(b)) {
+        if (cache.read(b, block)) break;
+        dir_entry* entries = (dir_entry*)block;
+        // slot 0 of the first block is always ".." and is never looked up
+        for (int i = (b == dir_block) ? 1 : 0; i < DIR_SIZE; i++) {
+            dir_slot where = {b, i};
+            if (entries[i].first_blk != 0)
+                info.names.emplace(entryName(entries[i]), where);
+            else
+                info.free_slots.push_back(where);
         }
-        strcpy(src_entry->file_name, destpath.c_str());
-        disk.write(current_dir_block, dir_block);
-        return 0;
+        info.last_block = b;
     }
+    // hand out the lowest free slots first
+    std::reverse(info.free_slots.begin(), info.free_slots.end());
+    return info;
+}
 
+std::string FS::entryName(const dir_entry& entry) {
+    return std::string(entry.file_name, strnlen(entry.file_name, sizeof(entry.file_name)));
+}
 
-    // Handle absolute/relative paths
-    if (destpath.find('/') != std::string::npos) {
-        std::vector<std::string> path_parts = splitPath(destpath);
-        if (path_parts.empty()) return -1;
+// Looks up name in the directory. Returns 0 and sets *where if it exists,
+// -1 otherwise.
+int FS::lookup(uint32_t dir_block, const std::string& name, dir_slot* where) {
+    std::lock_guard<std::mutex> lock(stripeOf(dir_block).lock);
+    dir_info& info = dirInfo(dir_block);
+    auto it = info.names.find(name);
+    if (it == info.names.end()) return -1;
+    if (where) *where = it->second;
+    return 0;
+}
 
-        uint16_t working_dir = isAbsolutePath(destpath) ? ROOT_BLOCK : current_dir_block;
+int FS::readEntry(const dir_slot& where, dir_entry* entry) {
+    return cache.read_range(where.block, where.slot * sizeof(dir_entry), entry, sizeof(dir_entry));
+}
 
-        // Navigate through path
-        for (const auto& part : path_parts) {
-            if (part == "..") {
-                uint8_t block[BLOCK_SIZE];
-                disk.read(working_dir, block);
-                dir_entry* dir_entries = (dir_entry*)block;
-                working_dir = dir_entries[0].parent_blk;
-            } else {
-                dir_entry* next_dir = findEntryInBlock(part, working_dir);
-                if (!next_dir || next_dir->type != TYPE_DIR) return -1;
-                working_dir = next_dir->first_blk;
+// Writes an entry and updates the files open on it
+int FS::writeEntry(const dir_slot& where, const dir_entry& entry) {
+    {
+        std::lock_guard<std::mutex> lock(files_lock);
+        for (auto& f : files) {
+            if (f.used && !f.removed && f.where.block == where.block && f.where.slot == where.slot) {
+                if (f.entry.first_blk != entry.first_blk) f.pos_block = -1;
+                f.entry = entry;
             }
         }
+    }
+    if (cache.write_range(where.block, where.slot * sizeof(dir_entry), &entry, sizeof(dir_entry)))
+        return -1;
+    return journal.add(where.block);
+}
 
-        dir_entry dest_dir;
-        dest_dir.first_blk = working_dir;
-        dest_dir.type = TYPE_DIR;
-        int result = copyToDirectory(src_entry, &dest_dir);
-        if (result == 0) {
-            entries[src_index].first_blk = 0;
-            disk.write(current_dir_block, dir_block);
-        }
-        return result;
+// Points the files open on the entry at from to its new slot to
+void FS::moveHandles(const dir_slot& from, const dir_slot& to) {
+    std::lock_guard<std::mutex> lock(files_lock);
+    for (auto& f : files) {
+        if (f.used && !f.removed && f.where.block == from.block && f.where.slot == from.slot)
+            f.where = to;
+    }
+}
+
+// Marks the files open on the entry at where as removed, so a new entry
+// in the slot is not mistaken for theirs
+void FS::dropHandles(const dir_slot& where) {
+    std::lock_guard<std::mutex> lock(files_lock);
+    for (auto& f : files) {
+        if (f.used && f.where.block == where.block && f.where.slot == where.slot)
+            f.removed = true;
     }
+}
 
-    // Check if destination is directory in current directory
+// Adds entry to the directory, growing the directory by one block when
+// all its slots are used. Returns -1 if the disk is full.
+int FS::addEntry(uint32_t dir_block, const dir_entry& entry) {
+    dir_info& info = dirInfo(dir_block);
+    if (info.free_slots.empty()) {
+        int new_block = allocBlock();
+        if (new_block == -1) return -1;
+        uint8_t empty[BLOCK_SIZE] = {0};
+        cache.write(new_block, empty);
+        journal.add(new_block);
+        setFat(info.last_block, new_block);
+        info.last_block = new_block;
+        for (int i = DIR_SIZE - 1; i >= 0; i--)
+            info.free_slots.push_back({(uint32_t)new_block, i});
+    }
+    dir_slot where = info.free_slots.back();
+    info.free_slots.pop_back();
+    writeEntry(where, entry);
+    std::string name = entryName(entry);
+    info.names[name] = where;
+    stripeOf(dir_block).dcache.erase({dir_block, name});
+    return 0;
+}
 
+// Clears the entry name from the directory
+int FS::removeEntry(uint32_t dir_block, const std::string& name) {
+    dir_info& info = dirInfo(dir_block);
+    auto it = info.names.find(name);
+    if (it == info.names.end()) return -1;
+    dir_slot where = it->second;
+    dropHandles(where);
+    dir_entry empty = {};
+    writeEntry(where, empty);
+    info.names.erase(it);
+    info.free_slots.push_back(where);
+    stripeOf(dir_block).dcache.erase({dir_block, name});
+    return 0;
+}
 
+// Renames an entry in place
+int FS::renameEntry(uint32_t dir_block, const std::string& name, const std::string& newname) {
+    dir_info& info = dirInfo(dir_block);
+    auto it = info.names.find(name);
+    if (it == info.names.end()) return -1;
+    dir_slot where = it->second;
+    dir_entry entry;
+    readEntry(where, &entry);
+    strcpy(entry.file_name, newname.c_str());
+    writeEntry(where, entry);
+    info.names.erase(it);
+    info.names[newname] = where;
+    index_stripe& stripe = stripeOf(dir_block);
+    stripe.dcache.erase({dir_block, name});
+    stripe.dcache.erase({dir_block, newname});
+    return 0;
+}
 
+// Returns the parent directory from the ".." entry of a directory
+uint32_t FS::parentOf(uint32_t dir_block) {
+    dir_entry dotdot;
+    readEntry({dir_block, 0}, &dotdot);
+    return dotdot.parent_blk;
 }
-std::string FS::cleanPath(const std::string& path) {
-    if (path.empty()) return path;
-    if (path[0] == '/') {
-        return path.substr(1);  // Remove leading '/'
+
+// Looks up one path component through the dentry cache. Misses go to the
+// directory index and are remembered, also when the name does not exist.
+FS::dentry FS::walk(uint32_t dir_block, const std::string& name) {
+    dentry_key key = {dir_block, name};
+    index_stripe& stripe = stripeOf(dir_block);
+    {
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        auto it = stripe.dcache.find(key);
+        if (it != stripe.dcache.end()) return it->second;
+    }
+
+    dentry d = {false, 0, 0};
+    dir_entry entry;
+    if (findEntryInBlock(name, dir_block, &entry) == 0) {
+        d.exists = true;
+        d.block = entry.first_blk;
+        d.type = entry.type;
     }
-    return path;
+    std::lock_guard<std::mutex> lock(stripe.lock);
+    if (stripe.dcache.size() >= DCACHE_SIZE / INDEX_STRIPES) stripe.dcache.clear();
+    stripe.dcache.emplace(key, d);
+    return d;
 }
 
-int FS::cp(std::string sourcepath, std::string destpath) {
-    // Find source file
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
-    dir_entry* src_entry = nullptr;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 && sourcepath == entries[i].file_name) {
-            src_entry = &entries[i];
-            break;
-        }
+// Resolves an absolute or relative path to a directory block. With
+// excludeLast the last component is skipped, which gives the directory a
+// new or existing entry lives in. Returns -1 if some component is missing
+// or is not a directory.
+int FS::navigateToPath(const std::string& path, bool excludeLast) {
+    std::vector<std::string> parts = splitPath(path);
+    if (excludeLast) {
+        if (parts.empty()) return -1;
+        parts.pop_back();
     }
-    if (!src_entry) return -1;
-
-    // Handle absolute path
-    if (isAbsolutePath(destpath)) {
-        // Read root directory
-        uint8_t root_block[BLOCK_SIZE];
-        disk.read(ROOT_BLOCK, root_block);
-        dir_entry* root_entries = (dir_entry*)root_block;
-
-        // Find destination directory
-        std::string target = cleanPath(destpath);
-        dir_entry* dest_dir = nullptr;
-
-        for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-            if (root_entries[i].first_blk != 0 &&
-                target == root_entries[i].file_name &&
-                root_entries[i].type == TYPE_DIR) {
-                dest_dir = &root_entries[i];
-                break;
-            }
+    uint32_t dir = isAbsolutePath(path) ? sb.root_blk : self().dir_block;
+    for (const auto& part : parts) {
+        if (part == ".") continue;
+        if (part == "..") {
+            dir = parentOf(dir);
+            continue;
         }
+        dentry d = walk(dir, part);
+        if (!d.exists || d.type != TYPE_DIR) return -1;
+        dir = d.block;
+    }
+    return dir;
+}
+
+// Returns the last component of a path, "" for "/"
+std::string FS::lastComponent(const std::string& path) {
+    std::vector<std::string> parts = splitPath(path);
+    return parts.empty() ? "" : parts.back();
+}
+
+// Finds the entry a path names. Also returns the directory holding it and
+// its name in that directory when dir/name are given.
+int FS::findPath(const std::string& path, dir_entry* entry, uint32_t* dir, std::string* name) {
+    int parent = navigateToPath(path, true);
+    if (parent == -1) return -1;
+    std::string last = lastComponent(path);
+    if (findEntryInBlock(last, parent, entry) == -1) return -1;
+    if (dir) *dir = parent;
+    if (name) *name = last;
+    return 0;
+}
+
+// Checks that name can be used for a new entry. Names longer than 55
+// characters are refused rather than cut short, they would not fit
+// file_name with its terminating zero.
+bool FS::validName(const std::string& name) {
+    return !name.empty() && name != "." && name != ".." &&
+           name.size() < sizeof(dir_entry::file_name);
+}
+
+// Formats the disk
+int FS::format() {
+    stats_timer timer(counters[FS_FORMAT]);
+    std::lock_guard<rw_lock> ns(ns_lock);
+    // Nothing is journaled while the disk is rewritten
+    journal.init(0, 0);
+    cache.unpin_all();
+
+    // Write the superblock
+    uint8_t block[BLOCK_SIZE] = {0};
+    initSuper();
+    std::memcpy(block, &sb, sizeof(sb));
+    cache.write(SUPER_BLOCK, block);
+
+    // Initialize FAT, reference counts and journal, the superblock, these
+    // regions and the root directory are reserved blocks
+    std::memset(block, 0, BLOCK_SIZE);
+    for (uint32_t i = FAT_START; i < sb.root_blk; i++)
+        cache.write(i, block);
+    for (uint32_t b = 0; b <= sb.root_blk; b++)
+        setFat(b, FAT_EOF);
+    buildFreeMap();
+
+    // Initialize root directory block
+    dir_entry* root_entries = (dir_entry*)block;
+
+    // Set up ".." entry in root directory
+    strcpy(root_entries[0].file_name, "..");
+    root_entries[0].first_blk = sb.root_blk;  // Points to itself
+    root_entries[0].type = TYPE_DIR;
+    root_entries[0].access_rights = READ | WRITE | EXECUTE;
+    root_entries[0].parent_blk = sb.root_blk;  // Root is its own parent
+    root_entries[0].size = 0;
 
-        if (!dest_dir) return -1;
+    // Write blocks
+    for (auto& stripe : stripes) {
+        stripe.dir_index.clear();
+        stripe.dcache.clear();
+        stripe.tail_cache.clear();
+        stripe.skip_index.clear();
+    }
+    for (auto& f : files) f.used = false;
+    cache.write(sb.root_blk, block);
+    cache.sync();
+    journal.init(sb.journal_start, sb.journal_blocks);
+    journal.reset();
+
+    // Every thread starts over in the root directory
+    mount_id = ++mounts;
+    cwd = std::make_shared<cwd_table>();
+
+    return 0;
+}
+// Starts writing a new, empty chain
+void FS::writerOpen(chain_writer& w) {
+    w.first = -1;
+    w.last = -1;
+    w.tail = -1;
+    w.size = 0;
+    w.fill = 0;
+    w.error = false;
+    w.buf.resize(IO_BATCH * BLOCK_SIZE);
+}
+
+// Returns the last block of the chain starting at first. The tail cache
+// saves walking the chain on every append to the same file.
+int FS::tailOf(uint32_t first) {
+    index_stripe& stripe = stripeOf(first);
+    std::unique_lock<std::mutex> lock(stripe.lock);
+    auto it = stripe.tail_cache.find(first);
+    int last = it != stripe.tail_cache.end() ? (int)it->second : -1;
+    lock.unlock();
+    if (last != -1 && getFat(last) == FAT_EOF)
+        return last;
+    last = first;
+    while (getFat(last) != FAT_EOF)
+        last = getFat(last);
+    lock.lock();
+    if (stripe.tail_cache.size() >= TAIL_CACHE_SIZE / INDEX_STRIPES) stripe.tail_cache.clear();
+    stripe.tail_cache[first] = last;
+    return last;
+}
 
-        // Copy to destination directory
-        dir_entry dest_dir_entry;
-        dest_dir_entry.first_blk = dest_dir->first_blk;
-        dest_dir_entry.type = TYPE_DIR;
+// Starts writing at the end of the file described by entry. A partly
+// used last block is loaded into the buffer and rewritten in place.
+int FS::writerOpenAppend(chain_writer& w, const dir_entry& entry) {
+    writerOpen(w);
+    w.first = entry.first_blk;
+    w.size = entry.size;
+    int last = tailOf(entry.first_blk);
+    // an empty file still has its one block
+    if (entry.size % BLOCK_SIZE == 0 && entry.size > 0) {
+        w.last = last;
+        return 0;
+    }
+    w.tail = last;
+    w.fill = entry.size % BLOCK_SIZE;
+    return cache.read_range(last, 0, w.buf.data(), w.fill);
+}
 
-        return copyToDirectory(src_entry, &dest_dir_entry);
+// Writes the buffered data to the end of the chain, allocating the blocks
+// it needs as one run if possible
+int FS::writerFlush(chain_writer& w) {
+    int count = (w.fill + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (count == 0) return 0;
+    std::memset(w.buf.data() + w.fill, 0, count * BLOCK_SIZE - w.fill);
+
+    std::vector<disk_iovec> iov;
+    int prev = w.last;
+    if (w.tail != -1) {
+        iov.push_back({(unsigned)w.tail, w.buf.data(), 0});
+        prev = w.tail;
     }
+    int needed = count - (int)iov.size();
+    if (needed > 0) {
+        int block = allocChain(needed);
+        if (block == -1) return -1;
+        if (prev != -1) setFat(prev, block);
+        else w.first = block;
+        for (; block != FAT_EOF; block = getFat(block))
+            iov.push_back({(unsigned)block, &w.buf[iov.size() * BLOCK_SIZE], 0});
+    }
+    if (cache.writev(iov)) return -1;
+
+    w.last = iov.back().block_no;
+    w.tail = -1;
+    w.fill = 0;
+    return 0;
+}
 
-    // Handle parent directory (..)
-    if (destpath == "..") {
-        dir_entry parent_dir;
-        parent_dir.first_blk = entries[0].parent_blk;
-        parent_dir.type = TYPE_DIR;
-        return copyToDirectory(src_entry, &parent_dir);
+// Adds len bytes to the file, writing every IO_BATCH full blocks. After
+// an error the data is dropped and -1 returned.
+int FS::writerPut(chain_writer& w, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    while (len > 0 && !w.error) {
+        size_t n = std::min(len, w.buf.size() - w.fill);
+        std::memcpy(&w.buf[w.fill], p, n);
+        w.fill += n;
+        w.size += n;
+        p += n;
+        len -= n;
+        if (w.fill == w.buf.size() && writerFlush(w))
+            w.error = true;
     }
+    return w.error ? -1 : 0;
+}
 
-    // Handle local directory or rename
-    dir_entry* dest_dir = findEntryInBlock(destpath, current_dir_block);
-    if (dest_dir && dest_dir->type == TYPE_DIR) {
-        return copyToDirectory(src_entry, dest_dir);
+// Writes what is left in the buffer. A file always has at least one
+// block, so that its first_blk is valid.
+int FS::writerClose(chain_writer& w) {
+    if (w.error || writerFlush(w)) return -1;
+    if (w.first == -1) {
+        w.first = allocBlock();
+        if (w.first == -1) return -1;
+        uint8_t empty[BLOCK_SIZE] = {0};
+        cache.write(w.first, empty);
     }
+    return 0;
+}
 
-    return copyWithNewName(src_entry, destpath);
+// Finds where a new entry for path goes. Fails if the directory does not
+// exist, the name is not valid or it is already used.
+int FS::newEntryPath(const std::string& path, uint32_t* dir, std::string* name) {
+    int parent = navigateToPath(path, true);
+    *name = lastComponent(path);
+    if (parent == -1 || !validName(*name)) return -1;
+    if (lookup(parent, *name) == 0) return -1;
+    *dir = parent;
+    return 0;
 }
-int FS::copyToDirectory(dir_entry* src_entry, dir_entry* dest_dir) {
-    uint8_t dest_block[BLOCK_SIZE];
-    disk.read(dest_dir->first_blk, dest_block);
-    dir_entry* dest_entries = (dir_entry*)dest_block;
 
-   // Check if file already exists in destination
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (dest_entries[i].first_blk != 0 &&
-            strcmp(dest_entries[i].file_name, src_entry->file_name) == 0) {
-            return -1;  // File exists
-        }
+// Finishes the writer and adds it as the file name in dir
+int FS::addFile(chain_writer& w, uint32_t dir, const std::string& name) {
+    if (writerClose(w) == 0) {
+        dir_entry entry = {};
+        strcpy(entry.file_name, name.c_str());
+        entry.size = w.size;
+        entry.first_blk = w.first;
+        entry.type = TYPE_FILE;
+        entry.access_rights = READ | WRITE;
+        entry.parent_blk = dir;
+        if (addEntry(dir, entry) == 0)
+            return 0;
+    }
+    if (w.first != -1) freeChain(w.first);
+    return -1;
+}
+
+// Creates the file filepath with len bytes of data
+int FS::createData(const std::string& filepath, const void* data, size_t len) {
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    uint32_t dir;
+    std::string name;
+    if (newEntryPath(filepath, &dir, &name)) return -1;
+
+    chain_writer w;
+    writerOpen(w);
+    writerPut(w, data, len);
+    return addFile(w, dir, name);
+}
+
+// Adds data to a file that is written before it is linked in, without
+// ns_lock. Each part is a journal operation of its own.
+int FS::writerPutUnlinked(chain_writer& w, const void* data, size_t len) {
+    journal_op op(journal);
+    if (op.failed()) w.error = true;
+    return writerPut(w, data, len);
+}
+
+// Adds the chain written by w as the file filepath. Only adding the entry
+// holds ns_lock, the name is checked again then and the chain is freed
+// if it can not be added.
+int FS::linkFile(chain_writer& w, const std::string& filepath) {
+    {
+        journal_op op(journal);
+        if (op.failed() || writerClose(w)) w.error = true;
     }
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    uint32_t dir;
+    std::string name;
+    if (op.failed() || w.error || newEntryPath(filepath, &dir, &name)) {
+        if (w.first != -1) freeChain(w.first);
+        return -1;
+    }
+    return addFile(w, dir, name);
+}
 
-    // Find free entry
-    int free_entry = -1;
-    for (int i = 1; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (dest_entries[i].first_blk == 0) {
-            free_entry = i;
-            break;
-        }
+// Creates a new file
+int FS::create(std::string filepath) {
+    stats_timer timer(counters[FS_CREATE]);
+    uint32_t dir;
+    std::string name;
+    {
+        shared_guard ns(ns_lock);
+        if (newEntryPath(filepath, &dir, &name)) return -1;
     }
-    if (free_entry == -1) return -1;
 
-    // Copy blocks and update FAT
-    int first_new_block = -1;
-    int prev_new_block = -1;
-    int src_block = src_entry->first_blk;
+    // Write the lines as they are read, the rest of the input is still
+    // consumed if the disk gets full. The file is linked in at the end.
+    chain_writer w;
+    writerOpen(w);
+    std::string line;
+    while (std::getline(std::cin, line) && !line.empty()) {
+        line += '\n';
+        writerPutUnlinked(w, line.data(), line.size());
+    }
+    timer.set_bytes(w.size);
 
-    while (src_block != FAT_EOF) {
-        int new_block = -1;
-        for (int i = 2; i < BLOCK_SIZE/2; i++) {
-            if (fat[i] == FAT_FREE) {
-                new_block = i;
-                break;
-            }
-        }
-        if (new_block == -1) return -1;
+    return linkFile(w, filepath);
+}
 
-        uint8_t block_data[BLOCK_SIZE];
-        disk.read(src_block, block_data);
-        disk.write(new_block, block_data);
+// Creates a new file with len bytes of data
+int FS::create(std::string filepath, const void* data, uint32_t len) {
+    stats_timer timer(counters[FS_CREATE], len);
+    return createData(filepath, data, len);
+}
 
-        if (first_new_block == -1) first_new_block = new_block;
-        if (prev_new_block != -1) fat[prev_new_block] = new_block;
+// import <fd> <filepath> creates the file <filepath> with everything that
+// can be read from the file descriptor fd
+int FS::import(int fd, std::string filepath) {
+    stats_timer timer(counters[FS_IMPORT]);
+    uint32_t dir;
+    std::string name;
+    {
+        shared_guard ns(ns_lock);
+        if (newEntryPath(filepath, &dir, &name)) return -1;
+    }
 
-        fat[new_block] = FAT_EOF;
-        prev_new_block = new_block;
-        src_block = fat[src_block];
+    // Write the data as it is read, the file is linked in at the end
+    chain_writer w;
+    writerOpen(w);
+    uint8_t data[BLOCK_SIZE];
+    ssize_t n;
+    while ((n = ::read(fd, data, BLOCK_SIZE)) > 0) {
+        if (writerPutUnlinked(w, data, n)) break;
     }
+    if (n < 0) w.error = true;
+    timer.set_bytes(w.size);
 
-    // Create directory entry
-    dest_entries[free_entry] = *src_entry;
-    dest_entries[free_entry].first_blk = first_new_block;
-    dest_entries[free_entry].parent_blk = dest_dir->first_blk;
+    return linkFile(w, filepath);
+}
+int FS::cat(std::string filepath) {
+    stats_timer timer(counters[FS_CAT]);
+    // Find the file, its directory is locked while it is read
+    shared_guard ns(ns_lock);
+    int dir = navigateToPath(filepath, true);
+    if (dir == -1) {
+        std::cerr << "Error: File not found\n";
+        return -1;
+    }
+    shared_guard dir_lock(dirLock(dir));
+    dir_entry entry;
+    if (findEntryInBlock(lastComponent(filepath), dir, &entry) == -1) {
+        std::cerr << "Error: File not found\n";
+        return -1;
+    }
+    if (entry.type == TYPE_DIR) {
+        std::cerr << "Error: Cannot cat a directory\n";
+        return -1;
+    }
+    int first_block = entry.first_blk;
+    uint32_t file_size = entry.size;
+    timer.set_bytes(file_size);
 
-    disk.write(dest_dir->first_blk, dest_block);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+    // Print the file one batch at a time while the next ones are read
+    return streamChain(first_block, file_size, [](const uint8_t* data, uint32_t len) {
+        std::cout.write((const char*)data, len);
+        return 0;
+    });
+}
 
+// read_to_fd <filepath> writes the content of the file to the file
+// descriptor fd. Blocks that are in the cache are written from there, runs
+// of other blocks are sent straight from the disk file with sendfile().
+// Returns the number of bytes written.
+int FS::read_to_fd(std::string filepath, int fd) {
+    // counted as a cat
+    stats_timer timer(counters[FS_CAT]);
+    shared_guard ns(ns_lock);
+    int dir = navigateToPath(filepath, true);
+    if (dir == -1) return -1;
+    shared_guard dir_lock(dirLock(dir));
+    dir_entry entry;
+    if (findEntryInBlock(lastComponent(filepath), dir, &entry) == -1 || entry.type == TYPE_DIR)
+        return -1;
+    timer.set_bytes(entry.size);
+
+    uint32_t remaining = entry.size;
+    int block = entry.first_blk;
+    uint8_t cached[BLOCK_SIZE];
+    while (block != FAT_EOF && remaining > 0) {
+        if (cache.peek(block, cached) == 0) {
+            uint32_t n = std::min(remaining, (uint32_t)BLOCK_SIZE);
+            if (writeAll(fd, cached, n)) return -1;
+            remaining -= n;
+            block = getFat(block);
+            continue;
+        }
+        // Collect consecutive blocks that are not cached
+        int start = block;
+        uint32_t count = 0;
+        do {
+            count++;
+            block = getFat(block);
+        } while (block == start + (int)count && (uint64_t)count * BLOCK_SIZE < remaining &&
+                 cache.peek(block, cached) == -1);
+        uint32_t n = std::min(remaining, count * BLOCK_SIZE);
+        if (disk.send_to_fd(fd, start, n)) return -1;
+        remaining -= n;
+    }
+    return entry.size;
+}
+
+// Writes all of data to fd
+int FS::writeAll(int fd, const uint8_t* data, uint32_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+// Lists the files in the current directory
+// Update ls() to show file types
+int FS::ls() {
+    stats_timer timer(counters[FS_LS]);
+    std::vector<dir_entry> entries;
+    if (list(entries)) return -1;
+    std::cout << "name\t type\t accessrights\t size\n";
+    for (const auto& entry : entries) {
+        std::string name = entryName(entry);
+        std::string type = (entry.type == TYPE_DIR) ? "dir" : "file";
+        std::string size = (entry.type == TYPE_DIR) ? "-" : std::to_string(entry.size);
+
+        // Format access rights
+        std::string rights = "";
+        rights += (entry.access_rights & READ) ? 'r' : '-';
+        rights += (entry.access_rights & WRITE) ? 'w' : '-';
+        rights += (entry.access_rights & EXECUTE) ? 'x' : '-';
+
+        printf("%-8s %-6s %-11s %s\n", name.c_str(), type.c_str(), rights.c_str(), size.c_str());
+    }
     return 0;
 }
 
-int FS::copyWithNewName(dir_entry* src_entry, std::string newname) {
+// Copies the entries of the current directory to entries, in the order
+// ls lists them
+int FS::list(std::vector<dir_entry>& entries) {
+    shared_guard ns(ns_lock);
+    uint32_t dir = self().dir_block;
+    shared_guard dir_lock(dirLock(dir));
     uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-// Check if file already exists
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 && strcmp(entries[i].file_name, newname.c_str()) == 0) {
-            return -1;  // File exists
+    for (int b = dir; b != FAT_EOF; b = getFat(b)) {
+        if (cache.read(b, dir_block)) return -1;
+        dir_entry* block_entries = (dir_entry*)dir_block;
+        for (int i = 0; i < DIR_SIZE; i++) {
+            // the root's ".." is not listed
+            if (block_entries[i].first_blk != 0 && !(b == (int)sb.root_blk && i == 0))
+                entries.push_back(block_entries[i]);
         }
     }
+    return 0;
+}
+// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
+// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+int FS::mv(std::string sourcepath, std::string destpath) {
+    stats_timer timer(counters[FS_MV]);
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    // Find source file
+    dir_entry src_entry;
+    uint32_t src_dir;
+    std::string src_name;
+    if (findPath(sourcepath, &src_entry, &src_dir, &src_name) == -1) return -1;
+
+    // Find destination: an existing directory keeps the name, otherwise
+    // the last component is the new name
+    int dest = navigateToPath(destpath);
+    std::string dest_name = src_name;
+    if (dest == -1) {
+        dest = navigateToPath(destpath, true);
+        dest_name = lastComponent(destpath);
+        if (dest == -1 || !validName(dest_name)) return -1;
+    }
+    uint32_t dest_dir = dest;
+    if (lookup(dest_dir, dest_name) == 0) {
+        return -1;  // Destination exists
+    }
 
-    // Find free entry
-    int free_entry = -1;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk == 0) {
-            free_entry = i;
-            break;
-        }
+    // Sessions in or below a moved directory find their path again
+    if (src_entry.type == TYPE_DIR) path_gen++;
+
+    // Simple rename
+    if (dest_dir == src_dir) {
+        return renameEntry(src_dir, src_name, dest_name);
     }
-    if (free_entry == -1) return -1;
-    // Copy blocks and update FAT
-    int first_new_block = -1;
-    int prev_new_block = -1;
-    int src_block = src_entry->first_blk;
-
-    while (src_block != FAT_EOF) {
-        int new_block = -1;
-        for (int i = 2; i < BLOCK_SIZE/2; i++) {
-            if (fat[i] == FAT_FREE) {
-                new_block = i;
-                break;
-            }
+
+    // A directory can't be moved into itself or one of its sub-directories
+    if (src_entry.type == TYPE_DIR) {
+        for (uint32_t d = dest_dir; ; d = parentOf(d)) {
+            if (d == src_entry.first_blk) return -1;
+            if (d == sb.root_blk) break;
         }
-        if (new_block == -1) return -1;
+    }
+
+    // Relink the entry, the data blocks stay where they are
+    dir_entry entry = src_entry;
+    strcpy(entry.file_name, dest_name.c_str());
+    entry.parent_blk = dest_dir;
+    if (addEntry(dest_dir, entry)) return -1;
+    dir_slot from, to;
+    lookup(src_dir, src_name, &from);
+    lookup(dest_dir, dest_name, &to);
+    moveHandles(from, to);
+    removeEntry(src_dir, src_name);
+
+    // A moved directory gets a new ".."
+    if (src_entry.type == TYPE_DIR) {
+        dir_entry dotdot;
+        readEntry({src_entry.first_blk, 0}, &dotdot);
+        dotdot.parent_blk = dest_dir;
+        writeEntry({src_entry.first_blk, 0}, dotdot);
+    }
+    return 0;
+}
 
-        uint8_t block_data[BLOCK_SIZE];
-        disk.read(src_block, block_data);
-        disk.write(new_block, block_data);
+// cp <sourcepath> <destpath> makes an exact copy of the file
+// <sourcepath> to a new file <destpath>
+int FS::cp(std::string sourcepath, std::string destpath) {
+    stats_timer timer(counters[FS_CP]);
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    // Find source file
+    dir_entry src_entry;
+    std::string src_name;
+    if (findPath(sourcepath, &src_entry, nullptr, &src_name) == -1) return -1;
+    if (src_entry.type == TYPE_DIR) return -1;
+
+    // Copy into an existing directory, or to a new name
+    int dest_dir = navigateToPath(destpath);
+    std::string dest_name = src_name;
+    if (dest_dir == -1) {
+        dest_dir = navigateToPath(destpath, true);
+        dest_name = lastComponent(destpath);
+        if (dest_dir == -1 || !validName(dest_name)) return -1;
+    }
 
-        if (first_new_block == -1) first_new_block = new_block;
-        if (prev_new_block != -1) fat[prev_new_block] = new_block;
+    return copyEntry(src_entry, dest_dir, dest_name);
+}
 
-        fat[new_block] = FAT_EOF;
-        prev_new_block = new_block;
-        src_block = fat[src_block];
+// Copies the file described by src_entry into dest_dir under name. The
+// copy shares the blocks of the source until one of them is written.
+int FS::copyEntry(const dir_entry& src_entry, uint32_t dest_dir, const std::string& name) {
+    // Check if file already exists in destination
+    if (lookup(dest_dir, name) == 0) {
+        return -1;  // File exists
     }
 
     // Create directory entry
-    entries[free_entry] = *src_entry;
-    entries[free_entry].first_blk = first_new_block;
-    strcpy(entries[free_entry].file_name, newname.c_str());
+    dir_entry entry = src_entry;
+    strcpy(entry.file_name, name.c_str());
+    entry.parent_blk = dest_dir;
+    if (addEntry(dest_dir, entry)) return -1;
 
-    disk.write(current_dir_block, dir_block);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+    // One more reference to the first block
+    setRef(src_entry.first_blk, getRef(src_entry.first_blk) + 1);
 
     return 0;
 }
-int FS::rm(std::string filepath) {
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
 
-    // Find entry
-    dir_entry* entry = nullptr;
-    int entry_index = -1;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 && filepath == entries[i].file_name) {
-            entry = &entries[i];
-            entry_index = i;
-            break;
+// Copies the FAT chain starting at src_block into newly allocated blocks,
+// moving IO_BATCH blocks per vectored read and write.
+// Returns the first block of the copy, or -1 if the disk is full.
+int FS::copyChain(int src_block) {
+    // Allocate the whole copy up front so it can be laid out contiguously
+    int count = 0;
+    for (int b = src_block; b != FAT_EOF; b = getFat(b)) count++;
+    int first_new_block = allocChain(count);
+    if (first_new_block == -1) return -1;
+
+    std::vector<disk_iovec> iov;
+    int new_block = first_new_block;
+    int ret = streamChain(src_block, count * BLOCK_SIZE, [&](const uint8_t* data, uint32_t len) {
+        iov.clear();
+        for (uint32_t off = 0; off < len; off += BLOCK_SIZE) {
+            iov.push_back({(unsigned)new_block, (uint8_t*)data + off, 0});
+            new_block = getFat(new_block);
         }
+        return cache.writev(iov) ? -1 : 0;
+    });
+    if (ret) return -1;
+    return first_new_block;
+}
+
+// streamChain reads the first size bytes of the chain starting at first
+// and hands them to out IO_BATCH blocks at a time, in order. Up to
+// AIO_DEPTH batches are read ahead: cached blocks are copied right away,
+// runs of consecutive uncached blocks are submitted to the disk as one
+// asynchronous request each, so the disk works on the next batches while
+// out handles the current one.
+int FS::streamChain(int first, uint32_t size, const std::function<int(const uint8_t*, uint32_t)>& out) {
+    struct batch {
+        std::vector<uint8_t> buf;
+        uint32_t len;
+        unsigned pending;   // requests not reaped yet
+        bool failed;
+    };
+    std::vector<batch> ring(AIO_DEPTH);
+    for (auto &b : ring) b.buf.resize(IO_BATCH * BLOCK_SIZE);
+    std::vector<disk_aio> done;
+
+    int block = first;
+    uint32_t queued = 0;
+    unsigned next_submit = 0, next_deliver = 0;
+    int ret = 0;
+    while (true) {
+        while (ret == 0 && next_submit - next_deliver < AIO_DEPTH &&
+               block != FAT_EOF && queued < size) {
+            unsigned slot = next_submit % AIO_DEPTH;
+            batch &b = ring[slot];
+            b.pending = 0;
+            b.failed = false;
+            disk_aio run = {0, 0, nullptr, false, slot, 0};
+            auto submitRun = [&]() {
+                if (run.count == 0) return;
+                if (cache.submit(run)) b.failed = true;
+                else b.pending++;
+                run.count = 0;
+            };
+            unsigned n = 0;
+            while (block != FAT_EOF && n < IO_BATCH && queued + n * BLOCK_SIZE < size) {
+                uint8_t *dst = &b.buf[n * BLOCK_SIZE];
+                if (cache.peek(block, dst) == 0) {
+                    submitRun();
+                } else if (run.count > 0 && (unsigned)block == run.block_no + run.count) {
+                    run.count++;
+                } else {
+                    submitRun();
+                    run.block_no = block;
+                    run.count = 1;
+                    run.buf = dst;
+                }
+                n++;
+                block = getFat(block);
+            }
+            submitRun();
+            b.len = std::min(n * BLOCK_SIZE, size - queued);
+            queued += b.len;
+            next_submit++;
+        }
+        if (next_deliver == next_submit) break;
+
+        // Wait for the oldest batch, then hand it out. After an error the
+        // remaining batches are only waited for.
+        batch &b = ring[next_deliver % AIO_DEPTH];
+        while (b.pending > 0) {
+            done.clear();
+            cache.reap(done, 1);
+            for (auto &d : done) {
+                ring[d.tag].pending--;
+                if (d.status) ring[d.tag].failed = true;
+            }
+        }
+        if (ret == 0 && (b.failed || out(b.buf.data(), b.len))) ret = -1;
+        next_deliver++;
     }
+    return ret;
+}
 
-    if (!entry) {
+int FS::rm(std::string filepath) {
+    stats_timer timer(counters[FS_RM]);
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    // Find entry
+    dir_entry entry;
+    uint32_t dir;
+    std::string name;
+    if (findPath(filepath, &entry, &dir, &name) == -1) {
         std::cerr << "Error: File/directory not found\n";
         return -1;
     }
 
     // Handle directory removal
-    if (entry->type == TYPE_DIR) {
-        uint8_t dir_content[BLOCK_SIZE];
-        disk.read(entry->first_blk, dir_content);
-        dir_entry* dir_entries = (dir_entry*)dir_content;
-
+    if (entry.type == TYPE_DIR) {
         // Check if empty (only ".." entry)
-        for (int i = 1; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-            if (dir_entries[i].first_blk != 0) {
-                std::cerr << "Error: Directory not empty\n";
-                return -1;
-            }
+        if (!dirInfo(entry.first_blk).names.empty()) {
+            std::cerr << "Error: Directory not empty\n";
+            return -1;
         }
-
-        // Free directory block
-        fat[entry->first_blk] = FAT_FREE;
-    } else {
-        // Free file blocks
-        int current_block = entry->first_blk;
-        while (current_block != FAT_EOF) {
-            int next_block = fat[current_block];
-            fat[current_block] = FAT_FREE;
-            current_block = next_block;
+        // no session, of this thread or any other, may be in it
+        bool in_use;
+        {
+            std::lock_guard<std::mutex> lock(cwd->lock);
+            in_use = cwd->refs.count(entry.first_blk) > 0;
+        }
+        if (in_use) {
+            std::cerr << "Error: Cannot remove the current directory\n";
+            return -1;
         }
+
+        // Forget the directory, its block may be reused for something else
+        stripeOf(entry.first_blk).dir_index.erase(entry.first_blk);
+        for (auto& stripe : stripes)
+            stripe.dcache.clear();
     }
+    // Free file/directory blocks that no other file shares
+    releaseChain(entry.first_blk);
+    forgetChain(entry.first_blk);
 
     // Clear directory entry
-    entry->first_blk = 0;
-
-    // Write updates
-    disk.write(current_dir_block, dir_block);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+    removeEntry(dir, name);
 
     return 0;
 }
 // append <filepath1> <filepath2> appends the contents of file <filepath1> to
 // the end of file <filepath2>. The file <filepath1> is unchanged.
 int FS::append(std::string filepath1, std::string filepath2) {
-    // Load current directory
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
+    stats_timer timer(counters[FS_APPEND]);
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
     // Find both files
-    dir_entry *entry1 = nullptr, *entry2 = nullptr;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 && filepath1 == entries[i].file_name) {
-            entry1 = &entries[i];
-        }
-        if (entries[i].first_blk != 0 && filepath2 == entries[i].file_name) {
-            entry2 = &entries[i];
+    dir_entry entry1, entry2;
+    uint32_t dir2;
+    std::string name2;
+    dir_slot where2;
+    if (findPath(filepath1, &entry1) == -1 ||
+        findPath(filepath2, &entry2, &dir2, &name2) == -1) {
+        std::cerr << "Error: File not found\n";
+        return -1;
+    }
+    if (entry1.type == TYPE_DIR || entry2.type == TYPE_DIR) return -1;
+    lookup(dir2, name2, &where2);
+
+    // Copy shared blocks before changing them
+    if (unshare(entry2, where2)) return -1;
+
+    chain_writer w;
+    if (writerOpenAppend(w, entry2)) return -1;
+    int old_last = w.tail != -1 ? w.tail : w.last;
+
+    // Stream the source file, IO_BATCH blocks per vectored read
+    std::vector<uint8_t> buf(IO_BATCH * BLOCK_SIZE);
+    std::vector<disk_iovec> iov;
+    int src_block = entry1.first_blk;
+    uint32_t remaining = entry1.size;
+    while (src_block != FAT_EOF && remaining > 0 && !w.error) {
+        iov.clear();
+        while (src_block != FAT_EOF && iov.size() < IO_BATCH &&
+               iov.size() * BLOCK_SIZE < remaining) {
+            iov.push_back({(unsigned)src_block, &buf[iov.size() * BLOCK_SIZE], 0});
+            src_block = getFat(src_block);
         }
+        if (cache.readv(iov)) w.error = true;
+        uint32_t len = std::min(remaining, (uint32_t)(iov.size() * BLOCK_SIZE));
+        writerPut(w, buf.data(), len);
+        remaining -= len;
     }
 
-    if (!entry1 || !entry2) {
-        std::cerr << "Error: File not found\n";
+    if (writerClose(w)) {
+        // Give back the blocks added so far, the file keeps its old size
+        int added = getFat(old_last);
+        if (added != FAT_EOF) {
+            setFat(old_last, FAT_EOF);
+            freeChain(added);
+        }
         return -1;
     }
 
-    // Find last block of destination file
-    int last_block2 = entry2->first_blk;
-    uint32_t last_block_offset = entry2->size % BLOCK_SIZE;
-    while (fat[last_block2] != FAT_EOF) {
-        last_block2 = fat[last_block2];
+    stripeOf(entry2.first_blk).tail_cache[entry2.first_blk] = w.last != -1 ? w.last : old_last;
+
+    // Update destination file size
+    entry2.size = w.size;
+    writeEntry(where2, entry2);
+
+    return 0;
+}
+
+// Returns the block at position index of the chain starting at first, or
+// FAT_EOF if the chain is shorter. Every SKIP_STRIDE-th block passed is
+// remembered, so a lookup walks at most SKIP_STRIDE - 1 FAT entries once
+// the chain has been walked. The FAT is walked without the stripe locked,
+// the blocks passed are added afterwards unless the chain was forgotten
+// or someone else added them in the meantime.
+int FS::blockAt(uint32_t first, uint32_t index) {
+    index_stripe& stripe = stripeOf(first);
+    uint32_t pos;
+    int block;
+    size_t known;
+    {
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        auto it = stripe.skip_index.find(first);
+        if (it == stripe.skip_index.end()) {
+            if (stripe.skip_index.size() >= SKIP_INDEX_SIZE / INDEX_STRIPES) stripe.skip_index.clear();
+            it = stripe.skip_index.emplace(first, std::vector<uint32_t>(1, first)).first;
+        }
+        std::vector<uint32_t>& marks = it->second;
+        known = marks.size();
+        pos = std::min((size_t)(index / SKIP_STRIDE), known - 1) * SKIP_STRIDE;
+        block = marks[pos / SKIP_STRIDE];
+    }
+    std::vector<uint32_t> found;
+    while (pos < index && block != FAT_EOF) {
+        block = getFat(block);
+        pos++;
+        if (pos % SKIP_STRIDE == 0 && block != FAT_EOF && pos / SKIP_STRIDE >= known)
+            found.push_back(block);
     }
+    if (!found.empty()) {
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        auto it = stripe.skip_index.find(first);
+        if (it != stripe.skip_index.end() && it->second.size() == known)
+            it->second.insert(it->second.end(), found.begin(), found.end());
+    }
+    return block;
+}
 
-    // Read last block of destination
-    uint8_t last_block_data[BLOCK_SIZE];
-    disk.read(last_block2, last_block_data);
+// Drops the cached positions of a chain that changed or was freed
+void FS::forgetChain(uint32_t first) {
+    {
+        index_stripe& stripe = stripeOf(first);
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        stripe.tail_cache.erase(first);
+        stripe.skip_index.erase(first);
+    }
+    std::lock_guard<std::mutex> lock(files_lock);
+    for (auto& f : files) {
+        if (f.used && f.entry.first_blk == first)
+            f.pos_block = -1;
+    }
+}
 
-    // Copy source file blocks
-    int src_block = entry1->first_blk;
-    uint32_t remaining_size = entry1->size;
-    uint32_t dest_offset = last_block_offset;
+// Returns the block at position index of the file. Accesses at or just
+// after the previous one continue from the block it ended in, others go
+// through the skip index.
+int FS::seekChain(open_file& f, uint32_t index) {
+    int block;
+    if (f.pos_block != -1 && f.pos_index <= index && index - f.pos_index < SKIP_STRIDE) {
+        block = f.pos_block;
+        for (uint32_t i = f.pos_index; i < index && block != FAT_EOF; i++)
+            block = getFat(block);
+    } else {
+        block = blockAt(f.entry.first_blk, index);
+    }
+    return block;
+}
 
-    while (src_block != FAT_EOF && remaining_size > 0) {
-        uint8_t src_data[BLOCK_SIZE];
-        disk.read(src_block, src_data);
+// Moves len bytes between buf and the file, beginning offset bytes into
+// it. Whole blocks go IO_BATCH at a time with vectored I/O, partial blocks
+// through the cache. The chain must be long enough.
+int FS::transferChain(open_file& f, uint32_t offset, uint32_t len, uint8_t* buf, bool write) {
+    uint32_t index = offset / BLOCK_SIZE;
+    int block = seekChain(f, index);
+    std::vector<disk_iovec> iov;
+    while (len > 0) {
+        if (block == FAT_EOF) return -1;
+        uint32_t off = offset % BLOCK_SIZE;
+        uint32_t n = std::min(len, (uint32_t)BLOCK_SIZE - off);
+        if (n == BLOCK_SIZE) {
+            iov.push_back({(unsigned)block, buf, 0});
+        } else if (write ? cache.write_range(block, off, buf, n)
+                         : cache.read_range(block, off, buf, n)) {
+            return -1;
+        }
+        if (iov.size() == IO_BATCH || n == len) {
+            if (!iov.empty() && (write ? cache.writev(iov) : cache.readv(iov))) return -1;
+            iov.clear();
+        }
+        f.pos_block = block;
+        f.pos_index = index++;
+        buf += n;
+        offset += n;
+        len -= n;
+        block = getFat(block);
+    }
+    return 0;
+}
 
-        uint32_t copy_size = std::min(static_cast<uint32_t>(BLOCK_SIZE - dest_offset),
-                                    remaining_size);
+// Resolves filepath for reading or writing its data
+int FS::openFile(const std::string& filepath, open_file& f) {
+    uint32_t dir;
+    std::string name;
+    if (findPath(filepath, &f.entry, &dir, &name) == -1 || f.entry.type == TYPE_DIR) return -1;
+    lookup(dir, name, &f.where);
+    f.used = true;
+    f.offset = 0;
+    f.pos_block = -1;
+    f.pos_index = 0;
+    f.ra_next = 0;
+    f.ra_window = 0;
+    f.ra_end = 0;
+    f.removed = false;
+    return 0;
+}
 
-        // If current block is full, allocate new block
-        if (dest_offset + copy_size > BLOCK_SIZE) {
-            // Find new block
-            int new_block = -1;
-            for (int i = 2; i < BLOCK_SIZE/2; i++) {
-                if (fat[i] == FAT_FREE) {
-                    new_block = i;
-                    break;
-                }
-            }
-            if (new_block == -1) return -1;
+// Returns the open file of fd, or nullptr if fd is not open or its file
+// has been removed
+FS::open_file* FS::handle(int fd) {
+    std::lock_guard<std::mutex> lock(files_lock);
+    if (fd < 0 || fd >= (int)files.size() || !files[fd].used || files[fd].removed) return nullptr;
+    return &files[fd];
+}
+
+int FS::readFile(open_file& f, uint32_t offset, uint32_t len, void* buf) {
+    if (offset >= f.entry.size) return 0;
+    len = std::min(len, f.entry.size - offset);
+    if (transferChain(f, offset, len, (uint8_t*)buf, false)) return -1;
+    readAhead(f, offset, len);
+    return len;
+}
+
+// Starts reading the next blocks of the file into the cache when the
+// reads of f are sequential. A read is sequential when it starts in the
+// block the previous one ended in or the block after it. New blocks are
+// requested once the reader is within half a window of the end of what
+// was read ahead.
+void FS::readAhead(open_file& f, uint32_t offset, uint32_t len) {
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t last = (offset + len - 1) / BLOCK_SIZE;
+    if (first == f.ra_next || first + 1 == f.ra_next) {
+        f.ra_window = f.ra_window ? std::min(f.ra_window * 2, (uint32_t)RA_MAX) : RA_MIN;
+    } else {
+        f.ra_window = 0;
+        f.ra_end = 0;
+    }
+    f.ra_next = last + 1;
+    if (f.ra_window == 0 || f.pos_block == -1) return;
+
+    uint32_t file_blocks = (f.entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t end = std::min(last + 1 + f.ra_window, file_blocks);
+    if (f.ra_end > last + 1 + f.ra_window / 2) return;
+    uint32_t from = std::max(f.ra_end, last + 1);
+    if (from >= end) return;
+
+    // transferChain left pos_block at the last block read
+    std::vector<unsigned> blocks;
+    int block = f.pos_block;
+    for (uint32_t index = f.pos_index + 1; index < end; index++) {
+        block = getFat(block);
+        if (block == FAT_EOF) break;
+        if (index >= from) blocks.push_back(block);
+    }
+    cache.readahead(blocks);
+    f.ra_end = end;
+}
 
-            // Link blocks
-            fat[last_block2] = new_block;
-            fat[new_block] = FAT_EOF;
-            last_block2 = new_block;
-            dest_offset = 0;
+// The caller holds ns_lock, a journal operation and the lock of the
+// directory of the file
+int FS::writeFile(open_file& f, uint32_t offset, uint32_t len, const void* buf) {
+    dir_entry& entry = f.entry;
+    if (len == 0) return 0;
+    uint64_t end = (uint64_t)offset + len;
+    if (end > UINT32_MAX) return -1;
+
+    // Copy shared blocks before changing them
+    if (unshare(entry, f.where)) return -1;
+
+    // Grow the chain to cover the write. New blocks are zeroed unless the
+    // write covers them completely; the unused part of the last block is
+    // always zero, so the old tail needs nothing.
+    uint32_t have = std::max((entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE, 1u);
+    uint32_t need = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int old_tail = -1;
+    if (need > have) {
+        int added = allocChain(need - have);
+        if (added == -1) return -1;
+        uint8_t zero[BLOCK_SIZE] = {0};
+        std::vector<disk_iovec> iov;
+        int last = added;
+        for (uint32_t i = have, b = added; b != (uint32_t)FAT_EOF; i++, b = getFat(b)) {
+            uint64_t start = (uint64_t)i * BLOCK_SIZE;
+            if (start < offset || start + BLOCK_SIZE > end)
+                iov.push_back({b, zero, 0});
+            last = b;
         }
+        if (cache.writev(iov)) {
+            freeChain(added);
+            return -1;
+        }
+        old_tail = tailOf(entry.first_blk);
+        setFat(old_tail, added);
+        index_stripe& stripe = stripeOf(entry.first_blk);
+        std::lock_guard<std::mutex> lock(stripe.lock);
+        stripe.tail_cache[entry.first_blk] = last;
+    }
+
+    if (transferChain(f, offset, len, (uint8_t*)buf, true)) {
+        // Give back the blocks added, the file keeps its old size
+        if (old_tail != -1) {
+            freeChain(getFat(old_tail));
+            setFat(old_tail, FAT_EOF);
+            forgetChain(entry.first_blk);
+        }
+        return -1;
+    }
+    if (end > entry.size) {
+        dir_entry updated = entry;
+        updated.size = end;
+        writeEntry(f.where, updated);
+        entry.size = end;
+    }
+    return len;
+}
 
-        // Copy data
-        std::memcpy(last_block_data + dest_offset, src_data, copy_size);
-        disk.write(last_block2, last_block_data);
+// pread <filepath> reads up to len bytes at offset of the file into buf.
+// Returns the number of bytes read, 0 at or past the end of the file.
+int FS::pread(std::string filepath, uint32_t offset, uint32_t len, void* buf) {
+    stats_timer timer(counters[FS_PREAD], len);
+    shared_guard ns(ns_lock);
+    open_file f;
+    if (openFile(filepath, f)) return -1;
+    // the entry is read again once no one can be writing the file
+    shared_guard dir_lock(dirLock(f.entry.parent_blk));
+    if (readEntry(f.where, &f.entry)) return -1;
+    return readFile(f, offset, len, buf);
+}
+
+// pwrite <filepath> writes len bytes from buf at offset of the file. A write
+// past the end grows the file, a gap before offset reads as zeros.
+// Returns the number of bytes written.
+int FS::pwrite(std::string filepath, uint32_t offset, uint32_t len, const void* buf) {
+    stats_timer timer(counters[FS_PWRITE], len);
+    shared_guard ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    open_file f;
+    if (openFile(filepath, f)) return -1;
+    std::lock_guard<rw_lock> dir_lock(dirLock(f.entry.parent_blk));
+    if (readEntry(f.where, &f.entry)) return -1;
+    return writeFile(f, offset, len, buf);
+}
 
-        remaining_size -= copy_size;
-        dest_offset += copy_size;
-        src_block = fat[src_block];
+// open <filepath> opens a file and returns its file descriptor. The
+// resolved entry is kept, so reads and writes through the descriptor do
+// no path lookups.
+int FS::open(std::string filepath) {
+    shared_guard ns(ns_lock);
+    open_file f;
+    if (openFile(filepath, f)) return -1;
+    std::lock_guard<std::mutex> lock(files_lock);
+    for (size_t fd = 0; fd < files.size(); fd++) {
+        if (!files[fd].used) {
+            files[fd] = f;
+            return fd;
+        }
     }
+    return -1;
+}
 
-    // Update destination file size
-    entry2->size += entry1->size;
+int FS::close(int fd) {
+    std::lock_guard<std::mutex> lock(files_lock);
+    if (fd < 0 || fd >= (int)files.size() || !files[fd].used) return -1;
+    files[fd].used = false;
+    return 0;
+}
+
+// read/write move len bytes at the offset of fd and advance it
+int FS::read(int fd, void* buf, uint32_t len) {
+    shared_guard ns(ns_lock);
+    open_file* f = handle(fd);
+    if (!f) return -1;
+    shared_guard dir_lock(dirLock(f->entry.parent_blk));
+    int n = readFile(*f, f->offset, len, buf);
+    if (n > 0) f->offset += n;
+    return n;
+}
+
+int FS::write(int fd, const void* buf, uint32_t len) {
+    shared_guard ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    open_file* f = handle(fd);
+    if (!f) return -1;
+    std::lock_guard<rw_lock> dir_lock(dirLock(f->entry.parent_blk));
+    int n = writeFile(*f, f->offset, len, buf);
+    if (n > 0) f->offset += n;
+    return n;
+}
+
+int FS::pread(int fd, uint32_t offset, uint32_t len, void* buf) {
+    shared_guard ns(ns_lock);
+    open_file* f = handle(fd);
+    if (!f) return -1;
+    shared_guard dir_lock(dirLock(f->entry.parent_blk));
+    return readFile(*f, offset, len, buf);
+}
 
-    // Write changes
-    disk.write(current_dir_block, dir_block);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
+int FS::pwrite(int fd, uint32_t offset, uint32_t len, const void* buf) {
+    shared_guard ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    open_file* f = handle(fd);
+    if (!f) return -1;
+    std::lock_guard<rw_lock> dir_lock(dirLock(f->entry.parent_blk));
+    return writeFile(*f, offset, len, buf);
+}
 
+int FS::seek(int fd, uint32_t offset) {
+    open_file* f = handle(fd);
+    if (!f) return -1;
+    f->offset = offset;
     return 0;
-}// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
-// in the current directory
+}
 
-// In fs.cpp
 std::vector<std::string> FS::splitPath(const std::string& path) {
     std::vector<std::string> parts;
     std::stringstream ss(path);
@@ -633,74 +1676,29 @@ bool FS::isAbsolutePath(const std::string& path) {
     return !path.empty() && path[0] == '/';
 }
 
-dir_entry* FS::findEntryInBlock(const std::string& name, uint16_t block) {
-    uint8_t block_data[BLOCK_SIZE];
-    disk.read(block, block_data);
-    dir_entry* entries = (dir_entry*)block_data;
-
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 && name == entries[i].file_name) {
-            return &entries[i];
-        }
-    }
-    return nullptr;
+// Looks up name in the directory starting at block and copies its entry
+// to *entry (and its location to *where). Returns -1 if it does not exist.
+int FS::findEntryInBlock(const std::string& name, uint32_t block, dir_entry* entry, dir_slot* where) {
+    dir_slot slot;
+    if (lookup(block, name, &slot) == -1) return -1;
+    if (readEntry(slot, entry)) return -1;
+    if (where) *where = slot;
+    return 0;
 }
+// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
+// in the current directory
 int FS::mkdir(std::string dirpath) {
-    uint16_t original_dir = current_dir_block;
-    uint16_t working_dir = current_dir_block;
-
-    std::vector<std::string> path_parts = splitPath(dirpath);
-    if (path_parts.empty()) return -1;
-
-    std::string target_name = path_parts.back();
-    path_parts.pop_back();
-
-    // Navigate through each path component
-    for (const auto& part : path_parts) {
-        if (part == "..") {
-            // Move back to parent directory
-            uint8_t block[BLOCK_SIZE];
-            disk.read(working_dir, block);
-            dir_entry* entries = (dir_entry*)block;
-            working_dir = entries[0].parent_blk;
-        } else {
-            // Find and enter directory
-            dir_entry* entry = findEntryInBlock(part, working_dir);
-            if (!entry || entry->type != TYPE_DIR) {
-                current_dir_block = original_dir;
-                return -1;
-            }
-            working_dir = entry->first_blk;
-        }
-    }
-
-    // Now working_dir is where we want to create the new directory
-    uint8_t block[BLOCK_SIZE];
-    disk.read(working_dir, block);
-    dir_entry* entries = (dir_entry*)block;
-
-    // Find free entry
-    int free_entry = -1;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk == 0) {
-            free_entry = i;
-            break;
-        }
-        if (strcmp(entries[i].file_name, target_name.c_str()) == 0) {
-            current_dir_block = original_dir;
-            return -1;
-        }
-    }
-    if (free_entry == -1) return -1;
+    stats_timer timer(counters[FS_MKDIR]);
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
+    // Find the directory to create the new directory in
+    uint32_t working_dir;
+    std::string target_name;
+    if (newEntryPath(dirpath, &working_dir, &target_name)) return -1;
 
     // Find free block
-    int new_block = -1;
-    for (int i = 2; i < BLOCK_SIZE/2; i++) {
-        if (fat[i] == FAT_FREE) {
-            new_block = i;
-            break;
-        }
-    }
+    int new_block = allocBlock();
     if (new_block == -1) return -1;
 
     // Create directory
@@ -713,89 +1711,75 @@ int FS::mkdir(std::string dirpath) {
     new_entries[0].access_rights = READ | WRITE | EXECUTE;
     new_entries[0].size = 0;
     new_entries[0].parent_blk = working_dir;
+    cache.write(new_block, new_dir);
+    journal.add(new_block);
+
+    dir_entry entry = {};
+    strcpy(entry.file_name, target_name.c_str());
+    entry.first_blk = new_block;
+    entry.type = TYPE_DIR;
+    entry.access_rights = READ | WRITE | EXECUTE;
+    entry.size = 0;
+    entry.parent_blk = working_dir;
+    if (addEntry(working_dir, entry)) {
+        freeBlock(new_block);
+        return -1;
+    }
 
-    strcpy(entries[free_entry].file_name, target_name.c_str());
-    entries[free_entry].first_blk = new_block;
-    entries[free_entry].type = TYPE_DIR;
-    entries[free_entry].access_rights = READ | WRITE | EXECUTE;
-    entries[free_entry].size = 0;
-    entries[free_entry].parent_blk = working_dir;
-
-    fat[new_block] = FAT_EOF;
-    disk.write(working_dir, block);
-    disk.write(new_block, new_dir);
-    disk.write(FAT_BLOCK, (uint8_t*)fat);
 
-    current_dir_block = original_dir;
     return 0;
 }
 int FS::cd(std::string dirpath) {
-       uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
-    if (dirpath == "..") {
-        // Don't move if already at root
-        if (current_dir_block == ROOT_BLOCK) {
-            return 0;
-        }
-
-        // Get parent block from first entry ("..")
-        current_dir_block = entries[0].parent_blk;
-
-        // Update current path
-        if (current_path != "/") {
-            size_t last_slash = current_path.find_last_of('/');
-            if (last_slash == 0) {
-                current_path = "/";
-            } else {
-                current_path = current_path.substr(0, last_slash);
-            }
-        }
-        return 0;
-    }
+    stats_timer timer(counters[FS_CD]);
+    shared_guard ns(ns_lock);
+    int dir = navigateToPath(dirpath);
+    if (dir == -1) return -1;
+    fs_session& session = self();
+    std::vector<std::string> parts;
+    if (!isAbsolutePath(dirpath)) parts = splitPath(sessionPath(session));
+    session.dir_block = dir;
+    session.ref = cwd_ref(cwd, dir);
 
-    // Navigate to subdirectory
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 &&
-            dirpath == entries[i].file_name &&
-            entries[i].type == TYPE_DIR) {
-            current_dir_block = entries[i].first_blk;
-            current_path = (current_path == "/") ?
-                          current_path + dirpath :
-                          current_path + "/" + dirpath;
-            return 0;
+    // Update current path
+    for (const auto& part : splitPath(dirpath)) {
+        if (part == ".") continue;
+        if (part == "..") {
+            // Don't move above root
+            if (!parts.empty()) parts.pop_back();
+        } else {
+            parts.push_back(part);
         }
     }
-    return -1;
+    session.path = "";
+    for (const auto& part : parts) session.path += "/" + part;
+    if (session.path.empty()) session.path = "/";
+    return 0;
 }
 
 int FS::pwd() {
-    std::cout << current_path << std::endl;
+    shared_guard ns(ns_lock);
+    std::cout << sessionPath(self()) << std::endl;
     return 0;
 }
-// Update ls() to show file types
 
 
 // chmod <accessrights> <filepath> changes the access rights for the
 // file <filepath> to <accessrights>.
 int FS::chmod(std::string accessrights, std::string filepath) {
-    uint8_t dir_block[BLOCK_SIZE];
-    disk.read(current_dir_block, dir_block);
-    dir_entry* entries = (dir_entry*)dir_block;
-
+    stats_timer timer(counters[FS_CHMOD]);
+    std::lock_guard<rw_lock> ns(ns_lock);
+    journal_op op(journal);
+    if (op.failed()) return -1;
     // Find file/directory
-    dir_entry* entry = nullptr;
-    for (int i = 0; i < BLOCK_SIZE/sizeof(dir_entry); i++) {
-        if (entries[i].first_blk != 0 && filepath == entries[i].file_name) {
-            entry = &entries[i];
-            break;
-        }
-    }
-    if (!entry) {
+    dir_entry entry;
+    uint32_t dir;
+    std::string name;
+    dir_slot where;
+    if (findPath(filepath, &entry, &dir, &name) == -1) {
         std::cerr << "Error: File not found\n";
         return -1;
     }
+    lookup(dir, name, &where);
 
     // Convert accessrights string to int
     int rights = std::stoi(accessrights);
@@ -805,7 +1789,62 @@ int FS::chmod(std::string accessrights, std::string filepath) {
     }
 
     // Update access rights
-    entry->access_rights = rights;
-    disk.write(current_dir_block, dir_block);
+    entry.access_rights = rights;
+    writeEntry(where, entry);
     return 0;
 }
+
+// names of the operations in the stats, by FS_FORMAT...
+static const char *op_names[FS_OPS] = {
+    "format", "create", "import", "cat", "ls", "cp", "mv", "rm",
+    "append", "mkdir", "cd", "chmod", "pread", "pwrite", "sync"
+};
+
+// stats prints the count, latencies and bytes of each operation and disk
+// call
+int FS::stats() {
+    writeStats(std::cout);
+    return 0;
+}
+
+void FS::writeStats(std::ostream& out) {
+    stats_header(out);
+    for (int i = 0; i < FS_OPS; i++)
+        stats_line(out, op_names[i], counters[i]);
+    for (int i = 0; i < DISK_CALLS; i++)
+        stats_line(out, std::string("disk_") + Disk::call_name(i), disk.get_stats(i));
+    out << "cache: " << cache.get_hits() << " hits, " << cache.get_misses() << " misses, "
+        << cache.get_writebacks() << " writebacks, " << cache.get_readaheads() << " read ahead\n";
+    out << "journal: " << journal.get_commits() << " commits, "
+        << journal.get_checkpoints() << " checkpoints\n";
+}
+
+// Writes the stats as JSON to the host file path
+int FS::dump_stats(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) return -1;
+    out << "{\n  \"operations\": [";
+    for (int i = 0; i < FS_OPS; i++) {
+        out << (i ? ",\n    " : "\n    ");
+        stats_json(out, op_names[i], counters[i]);
+    }
+    out << "\n  ],\n  \"disk\": [";
+    for (int i = 0; i < DISK_CALLS; i++) {
+        out << (i ? ",\n    " : "\n    ");
+        stats_json(out, Disk::call_name(i), disk.get_stats(i));
+    }
+    out << "\n  ],\n  \"cache\": {\"hits\": " << cache.get_hits()
+        << ", \"misses\": " << cache.get_misses()
+        << ", \"writebacks\": " << cache.get_writebacks()
+        << ", \"readaheads\": " << cache.get_readaheads() << "}"
+        << ",\n  \"journal\": {\"commits\": " << journal.get_commits()
+        << ", \"checkpoints\": " << journal.get_checkpoints() << "}\n}\n";
+    out.close();
+    return out ? 0 : -1;
+}
+
+void FS::reset_stats() {
+    for (auto &c : counters)
+        c.reset();
+    disk.reset_stats();
+}
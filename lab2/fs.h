@@ -2,16 +2,36 @@
 #include <cstdint>
 #include <string>
 #include "disk.h"
+#include "cache.h"
+#include "journal.h"
+#include "lock.h"
 #include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 
 #ifndef __FS_H__
 #define __FS_H__
 
-#define ROOT_BLOCK 0
-#define FAT_BLOCK 1
+// disk layout: superblock, FAT (sb.fat_blocks blocks), reference count
+// table (as many blocks as the FAT, from sb.ref_start), journal, root
+// directory
+#define SUPER_BLOCK 0
+#define FAT_START 1
 #define FAT_FREE 0
 #define FAT_EOF -1
+// FAT entries are 32 bits
+#define FAT_PER_BLOCK (BLOCK_SIZE/4)
+
+#define FS_MAGIC 0x46415433 // "FAT3"
+#define FS_VERSION 3
+
+// the journal gets 1/32 of the disk, within these limits
+#define JOURNAL_MIN 64
+#define JOURNAL_MAX 4096
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
@@ -19,49 +39,345 @@
 #define WRITE 0x02
 #define EXECUTE 0x01
 
-// #define DIR_SIZE BLOCK_SIZE/sizeof(dir_entry)
-// #define FAT_ENTRIES BLOCK_SIZE/2
+// number of blocks moved per vectored read/write when walking a file
+#define IO_BATCH 32
+// batches read ahead asynchronously when streaming a file
+#define AIO_DEPTH 4
+
+#define DIR_SIZE (int)(BLOCK_SIZE/sizeof(dir_entry))
+// the dentry cache is dropped when it reaches this many entries
+#define DCACHE_SIZE 4096
+// and the tail cache when it has this many files
+#define TAIL_CACHE_SIZE 1024
+// the skip index remembers every SKIP_STRIDE-th block of a chain, for up
+// to SKIP_INDEX_SIZE files
+#define SKIP_STRIDE 64
+#define SKIP_INDEX_SIZE 1024
+// the caches above are split into this many stripes with a lock each
+#define INDEX_STRIPES 16
+// blocks read ahead of a sequential reader: the window starts at RA_MIN
+// and doubles with every sequential read up to RA_MAX
+#define RA_MIN 4
+#define RA_MAX 16
+// most files open at the same time
+#define MAX_OPEN_FILES 1024
+// directories are locked through this many reader/writer locks, chosen by
+// the first block of the directory
+#define DIR_LOCK_STRIPES 64
+
+// operations of the FS counted in its stats
+#define FS_FORMAT 0
+#define FS_CREATE 1
+#define FS_IMPORT 2
+#define FS_CAT 3
+#define FS_LS 4
+#define FS_CP 5
+#define FS_MV 6
+#define FS_RM 7
+#define FS_APPEND 8
+#define FS_MKDIR 9
+#define FS_CD 10
+#define FS_CHMOD 11
+#define FS_PREAD 12
+#define FS_PWRITE 13
+#define FS_SYNC 14
+#define FS_OPS 15
+
+// block 0 of a formatted disk
+struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t no_blocks;   // size of the disk in blocks
+    uint32_t fat_blocks;  // number of FAT blocks, starting at FAT_START
+    uint32_t ref_start;   // first block of the reference count table
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t root_blk;    // first block of the root directory
+};
 
 struct dir_entry {
-    char file_name[56]; // name of the file / sub-directory
+    char file_name[56]; // name of the file / sub-directory, at most 55 chars
     uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
+    uint32_t first_blk; // index in the FAT for the first block of the file
     uint8_t type; // directory (1) or file (0)
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
-    uint16_t parent_blk; // index in the FAT for the parent directory
+    uint32_t parent_blk; // index in the FAT for the parent directory
 
 };
 
-class FS {
+// A directory is a FAT chain of blocks filled with dir_entry slots. Slot 0
+// of the first block is the ".." entry, a directory that fits in one block
+// has exactly the original single-block layout.
+
+// location of a dir_entry: directory block and slot within that block
+struct dir_slot {
+    uint32_t block;
+    int slot;
+};
+
+// key of the dentry cache: a name within a directory
+struct dentry_key {
+    uint32_t parent;
+    std::string name;
+    bool operator==(const dentry_key& o) const {
+        return parent == o.parent && name == o.name;
+    }
+};
+
+struct dentry_hash {
+    size_t operator()(const dentry_key& k) const {
+        return std::hash<std::string>()(k.name) * 31 + k.parent;
+    }
+};
+
+// state of a file being written sequentially: data is collected in buf
+// and written IO_BATCH blocks at a time to the end of the chain
+struct chain_writer {
+    int first;      // first block of the chain, -1 while empty
+    int last;       // last block written, -1 while empty
+    int tail;       // allocated block that buf starts with, or -1
+    uint32_t size;  // size of the file so far
+    uint32_t fill;  // bytes used in buf
+    bool error;     // set when a write or allocation failed
+    std::vector<uint8_t> buf;
+};
+
+// sessions using each directory as working directory, by first block.
+// Shared by an FS and its sessions, a session may outlive the FS.
+struct cwd_table {
+    std::mutex lock;
+    std::unordered_map<uint32_t, unsigned> refs;
+};
+
+// keeps a directory from being removed while it is a working directory
+class cwd_ref {
 private:
-    int moveToDirectory(dir_entry* src_entry, int src_index, dir_entry* dest_dir);
+    std::shared_ptr<cwd_table> table;
+    uint32_t dir;
+    void acquire();
+    void release();
+public:
+    cwd_ref() : dir(0) {}
+    cwd_ref(const std::shared_ptr<cwd_table>& table, uint32_t dir) : table(table), dir(dir) { acquire(); }
+    cwd_ref(const cwd_ref& o) : table(o.table), dir(o.dir) { acquire(); }
+    cwd_ref& operator=(const cwd_ref& o);
+    ~cwd_ref() { release(); }
+};
 
-    int copyToDirectory(dir_entry* src_entry, dir_entry* dest_dir);
-    int copyWithNewName(dir_entry* src_entry, std::string newname);
+// working directory of one thread or server connection, see FS::self().
+// Every copy holds the directory.
+struct fs_session {
+    uint32_t dir_block;
+    std::string path;
+    unsigned mount;     // id of the mount or format it belongs to
+    unsigned path_gen;  // FS::path_gen when path was last right
+    cwd_ref ref;        // on dir_block
+};
+
+// FS can be used from several threads. ns_lock is held exclusively by the
+// operations that change the directory tree (create, import, mkdir, rm,
+// mv, cp, append, chmod, format) and shared by all others. create and
+// import write the file first and only hold it to link the file in.
+// Reads and writes of file data also lock the directory holding the
+// file, shared to read and exclusively to write, so readers only wait
+// for writers of the same directory. With ns_lock shared the caches of the FS have their own
+// locks: a lock per stripe of the directory index, dentry, tail and skip
+// caches, alloc_lock for the free-space map and cow_lock for the
+// reference counts. Each thread has its own working directory, which rm
+// refuses to remove. A file descriptor must not be used by two threads at
+// the same time.
+class FS {
+private:
+    // result of one path component lookup, also kept for missing names
+    struct dentry {
+        bool exists;
+        uint32_t block;     // first block of the entry
+        uint8_t type;
+    };
+    int copyEntry(const dir_entry& src_entry, uint32_t dest_dir, const std::string& name);
+    int copyChain(int src_block);
+    int streamChain(int first, uint32_t size, const std::function<int(const uint8_t*, uint32_t)>& out);
+    // sequential writing of files
+    void writerOpen(chain_writer& w);
+    int tailOf(uint32_t first);
+    int blockAt(uint32_t first, uint32_t index);
+    void forgetChain(uint32_t first);
+    // a file opened by open(), or resolved for a single pread/pwrite
+    struct open_file {
+        bool used;
+        dir_entry entry;    // copy of the entry, kept current by writeEntry
+        dir_slot where;     // slot of the entry
+        uint32_t offset;    // offset of the next read/write
+        int pos_block;      // block the last access ended in, -1 if none
+        uint32_t pos_index; // position of pos_block in the chain
+        uint32_t ra_next;   // block index where a sequential read continues
+        uint32_t ra_window; // readahead window in blocks, 0 if not sequential
+        uint32_t ra_end;    // blocks before this index have been read ahead
+        bool removed;       // the entry was removed, only close() works
+    };
+    int seekChain(open_file& f, uint32_t index);
+    int transferChain(open_file& f, uint32_t offset, uint32_t len, uint8_t* buf, bool write);
+    int openFile(const std::string& filepath, open_file& f);
+    open_file* handle(int fd);
+    int readFile(open_file& f, uint32_t offset, uint32_t len, void* buf);
+    void readAhead(open_file& f, uint32_t offset, uint32_t len);
+    int writeFile(open_file& f, uint32_t offset, uint32_t len, const void* buf);
+    void moveHandles(const dir_slot& from, const dir_slot& to);
+    void dropHandles(const dir_slot& where);
+    int writeAll(int fd, const uint8_t* data, uint32_t len);
+    int writerOpenAppend(chain_writer& w, const dir_entry& entry);
+    int writerFlush(chain_writer& w);
+    int writerPut(chain_writer& w, const void* data, size_t len);
+    int writerClose(chain_writer& w);
+    int newEntryPath(const std::string& path, uint32_t* dir, std::string* name);
+    int addFile(chain_writer& w, uint32_t dir, const std::string& name);
+    int createData(const std::string& filepath, const void* data, size_t len);
+    int writerPutUnlinked(chain_writer& w, const void* data, size_t len);
+    int linkFile(chain_writer& w, const std::string& filepath);
+    void initSuper();
+    // FAT entries, paged in through the cache
+    int getFat(uint32_t block);
+    void setFat(uint32_t block, int value);
+    // references to a block beyond the first one: a block is shared by
+    // cp'd files when it, or a block before it in the chain, has any
+    int getRef(uint32_t block);
+    void setRef(uint32_t block, int value);
+    void releaseChain(int block);
+    int unshare(dir_entry& entry, const dir_slot& where);
+    // free-space index over the FAT
+    void buildFreeMap();
+    int allocBlock();
+    int findRun(int count);
+    int allocChain(int count);
+    void freeBlock(int block);
+    void freeChain(int block);
     std::vector<std::string> splitPath(const std::string& path);
-    dir_entry* findEntryInBlock(const std::string& name, uint16_t block);
+    int findEntryInBlock(const std::string& name, uint32_t block, dir_entry* entry,
+                         dir_slot* where = nullptr);
+    // in-memory index of one directory, built on first access
+    struct dir_info {
+        std::unordered_map<std::string, dir_slot> names;
+        std::vector<dir_slot> free_slots;   // lowest slot last
+        uint32_t last_block;                // last block of the chain
+    };
+    dir_info& dirInfo(uint32_t dir_block);
+    std::string entryName(const dir_entry& entry);
+    int lookup(uint32_t dir_block, const std::string& name, dir_slot* where = nullptr);
+    int readEntry(const dir_slot& where, dir_entry* entry);
+    int writeEntry(const dir_slot& where, const dir_entry& entry);
+    int addEntry(uint32_t dir_block, const dir_entry& entry);
+    int removeEntry(uint32_t dir_block, const std::string& name);
+    int renameEntry(uint32_t dir_block, const std::string& name, const std::string& newname);
+    uint32_t parentOf(uint32_t dir_block);
+    // path resolution
+    dentry walk(uint32_t dir_block, const std::string& name);
     int navigateToPath(const std::string& path, bool excludeLast = false);
+    std::string lastComponent(const std::string& path);
+    int findPath(const std::string& path, dir_entry* entry, uint32_t* dir = nullptr,
+                 std::string* name = nullptr);
+    bool validName(const std::string& name);
     bool isAbsolutePath(const std::string& path);
-    std::string cleanPath(const std::string& path);
     Disk disk;
-    // size of a FAT entry is 2 bytes
-    std::string current_path;  // Add this member
-
-    uint16_t current_dir_block; // Tracks current directory block number
-    int16_t fat[BLOCK_SIZE/2];
+    Cache cache;
+    Journal journal;
+    superblock sb;
+    // sessions of the threads, found by the id of the mount
+    unsigned mount_id;
+    fs_session& self();
+    // working directories of all sessions, rm leaves them alone
+    std::shared_ptr<cwd_table> cwd;
+    // changes when a directory is moved or renamed, which makes the
+    // paths of older sessions stale
+    unsigned path_gen;
+    const std::string& sessionPath(fs_session& session);
+    std::string pathOf(uint32_t dir_block);
+    rw_lock ns_lock;
+    rw_lock dir_locks[DIR_LOCK_STRIPES];
+    rw_lock& dirLock(uint32_t dir_block);
+    std::recursive_mutex alloc_lock;
+    std::mutex cow_lock;
+    std::mutex files_lock;
+    // One stripe of the caches. Directories are in the stripe of their
+    // first block, with the path components looked up in them, and files
+    // in the stripe of the first block of their chain.
+    struct index_stripe {
+        std::mutex lock;
+        // indexes of the directories used so far, keyed by first block
+        std::unordered_map<uint32_t, dir_info> dir_index;
+        // recently resolved path components
+        std::unordered_map<dentry_key, dentry, dentry_hash> dcache;
+        // last block of recently appended files, keyed by first block
+        std::unordered_map<uint32_t, uint32_t> tail_cache;
+        // block positions of recently read or written files, keyed by first block
+        std::unordered_map<uint32_t, std::vector<uint32_t>> skip_index;
+    };
+    index_stripe stripes[INDEX_STRIPES];
+    index_stripe& stripeOf(uint32_t block) { return stripes[block % INDEX_STRIPES]; }
+    // open files, indexed by file descriptor. The table has its full size
+    // from the start, so a handle stays where it is.
+    std::vector<open_file> files;
+    // one bit per FAT entry, set while the block is free
+    std::vector<uint64_t> free_map;
+    unsigned free_hint; // word where the last allocation was found
+    int run_miss;       // shortest run findRun failed to find since
+                        // blocks were last freed, 0 if none
+    // blocks freed by transactions that are not committed yet, oldest
+    // first, with the transaction that freed them. Until the commit a
+    // crash brings the freed chain back, so the blocks are not reused.
+    std::deque<std::pair<unsigned long, int>> pending_free;
+    void releaseFreed();
+    // calls, bytes and latencies of each operation, see FS_FORMAT...
+    op_stats counters[FS_OPS];
+    void writeStats(std::ostream& out);
 
 public:
-    FS();
+    // mounts the file system on the disk file diskname, see Disk for
+    // no_blocks. The block cache holds up to cache_blocks blocks.
+    FS(const std::string& diskname = DISKNAME, unsigned no_blocks = 0,
+       unsigned cache_blocks = CACHE_BLOCKS);
     ~FS();
     // formats the disk, i.e., creates an empty file system
     int format();
+    // sync commits the journal and writes all cached changes back to the disk
+    int sync();
+    // commits metadata changes in groups of ops operations, or when the
+    // oldest change is delay_ms old (see Journal::set_group)
+    void set_commit_group(unsigned ops, unsigned delay_ms);
+    // the setting made by set_commit_group()
+    void get_commit_group(unsigned* ops, unsigned* delay_ms);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    // creates the file <filepath> with len bytes of data
+    int create(std::string filepath, const void* data, uint32_t len);
+    // import <fd> <filepath> creates a new file with the data read from
+    // the file descriptor fd until end of file
+    int import(int fd, std::string filepath);
+    // pread/pwrite read or write len bytes at offset of the file <filepath>
+    // and return the number of bytes moved, pwrite grows the file if needed
+    int pread(std::string filepath, uint32_t offset, uint32_t len, void* buf);
+    int pwrite(std::string filepath, uint32_t offset, uint32_t len, const void* buf);
+    // open <filepath> returns a file descriptor for the file, or -1. Reads
+    // and writes through it skip the path lookup. A removed file's
+    // descriptor fails until it is closed.
+    int open(std::string filepath);
+    int close(int fd);
+    // read/write at the offset of fd and move it forward
+    int read(int fd, void* buf, uint32_t len);
+    int write(int fd, const void* buf, uint32_t len);
+    int pread(int fd, uint32_t offset, uint32_t len, void* buf);
+    int pwrite(int fd, uint32_t offset, uint32_t len, const void* buf);
+    int seek(int fd, uint32_t offset);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
+    // read_to_fd <filepath> writes the content of a file to the file
+    // descriptor fd, returns the number of bytes written
+    int read_to_fd(std::string filepath, int fd);
     // ls lists the content in the current directory (files and sub-directories)
     int ls();
+    // list copies the entries of the current directory to entries
+    int list(std::vector<dir_entry>& entries);
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
     // <sourcepath> to a new file <destpath>
@@ -78,15 +394,33 @@ public:
     // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
     // in the current directory
     int mkdir(std::string dirpath);
-    // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+    // cd <dirpath> changes the current (working) directory to the directory
+    // named <dirpath>, for the calling thread only
     int cd(std::string dirpath);
     // pwd prints the full path, i.e., from the root directory, to the current
     // directory, including the current directory name
     int pwd();
+    // the working directory of the calling thread. A server running
+    // several sessions on few threads switches between them with these.
+    fs_session get_session();
+    void set_session(const fs_session& session);
 
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // blocks read from and written to the disk since it was mounted
+    unsigned long get_blocks_read() { return disk.get_blocks_read(); }
+    unsigned long get_blocks_written() { return disk.get_blocks_written(); }
+
+    // stats prints the count, average, p50, p99 and max latency and bytes
+    // of each FS operation and Disk call so far, and the counters of the
+    // cache and the journal
+    int stats();
+    // writes the same, with the latency histograms, as JSON to the host
+    // file path
+    int dump_stats(const std::string& path);
+    void reset_stats();
 };
 
 #endif // __FS_H__
@@ -0,0 +1,336 @@
+#include <iostream>
+#include <cstring>
+#include "journal.h"
+
+
+Journal::Journal(Disk &disk, Cache &cache) : disk(disk), cache(cache)
+{
+    start = 0;
+    size = 0;
+    head = 0;
+    seq = 1;
+    ops = 0;
+    group_ops = JOURNAL_GROUP;
+    group_delay = std::chrono::milliseconds(JOURNAL_DELAY_MS);
+    commits = 0;
+    checkpoints = 0;
+    active = 0;
+    synced = 0;
+    stop = false;
+    committer = std::thread(&Journal::commit_late, this);
+}
+
+Journal::~Journal()
+{
+    {
+        std::lock_guard<std::mutex> l(lock);
+        stop = true;
+    }
+    started.notify_all();
+    idle.notify_all();
+    committer.join();
+}
+
+void Journal::init(unsigned start, unsigned size) {
+    std::lock_guard<std::mutex> l(lock);
+    this->start = start;
+    this->size = size;
+    head = 0;
+    ops = 0;
+    tx.clear();
+}
+
+// A transaction never needs more log blocks than it has ranges, it has
+// to fit in the log with its descriptor and commit block and its ranges
+// in one descriptor
+unsigned Journal::max_tx() {
+    unsigned n = size - 3;
+    unsigned ranges = (BLOCK_SIZE - 16) / sizeof(range);
+    return n < ranges ? n : ranges;
+}
+
+// FNV-1a over the descriptor and the logged data
+uint32_t Journal::checksum(const uint8_t *desc, const std::vector<disk_iovec>& iov) {
+    uint32_t h = 2166136261u;
+    for (unsigned i = 0; i < BLOCK_SIZE; i++)
+        h = (h ^ desc[i]) * 16777619u;
+    for (auto &v : iov) {
+        for (unsigned i = 0; i < BLOCK_SIZE; i++)
+            h = (h ^ v.blk[i]) * 16777619u;
+    }
+    return h;
+}
+
+int Journal::write_header() {
+    uint8_t block[BLOCK_SIZE] = {0};
+    header *h = (header*)block;
+    h->magic = JOURNAL_MAGIC;
+    h->seq = seq;
+    if (disk.write(start, block))
+        return -1;
+    return disk.sync();
+}
+
+int Journal::replay() {
+    if (start == 0)
+        return 0;
+    uint8_t block[BLOCK_SIZE];
+    if (disk.read(start, block))
+        return -1;
+    header *h = (header*)block;
+    if (h->magic != JOURNAL_MAGIC)
+        return reset();
+    seq = h->seq;
+
+    // apply transactions until one is missing or incomplete
+    unsigned pos = 0;
+    unsigned replayed = 0;
+    uint8_t desc_block[BLOCK_SIZE];
+    descriptor *desc = (descriptor*)desc_block;
+    std::vector<uint8_t> data;
+    std::vector<disk_iovec> iov;
+    while (pos + 2 < size - 1) {
+        if (disk.read(start + 1 + pos, desc_block))
+            break;
+        if (desc->magic != JOURNAL_MAGIC || desc->seq != seq || desc->count == 0 ||
+            desc->count > (BLOCK_SIZE - 16) / sizeof(range) || pos + desc->data + 2 > size - 1)
+            break;
+        data.resize(desc->data * BLOCK_SIZE);
+        iov.clear();
+        for (unsigned i = 0; i < desc->data; i++)
+            iov.push_back({start + 2 + pos + i, &data[i * BLOCK_SIZE], 0});
+        if (disk.readv(iov))
+            break;
+        commit_block *c = (commit_block*)block;
+        if (disk.read(start + 2 + pos + desc->data, block))
+            break;
+        if (c->magic != COMMIT_MAGIC || c->seq != seq || c->data != desc->data ||
+            c->checksum != checksum(desc_block, iov))
+            break;
+
+        // the transaction is complete, patch its ranges into the blocks
+        size_t off = 0;
+        for (unsigned i = 0; i < desc->count; i++) {
+            range &r = desc->ranges[i];
+            if (r.offset + r.len > BLOCK_SIZE || off + r.len > data.size() ||
+                disk.read(r.block_no, block))
+                return -1;
+            std::memcpy(block + r.offset, &data[off], r.len);
+            if (disk.write(r.block_no, block))
+                return -1;
+            off += r.len;
+        }
+        pos += desc->data + 2;
+        seq++;
+        replayed++;
+    }
+    if (replayed > 0)
+        std::cerr << "Journal: replayed " << replayed << " transactions\n";
+    return reset();
+}
+
+int Journal::reset() {
+    head = 0;
+    if (start == 0)
+        return 0;
+    if (disk.sync())
+        return -1;
+    return write_header();
+}
+
+// the running transaction has enough operations, or has waited long enough
+bool Journal::group_done() {
+    return !tx.empty() && (ops >= group_ops ||
+                           std::chrono::steady_clock::now() - first_op > group_delay);
+}
+
+// the running transaction has no room for one more operation
+bool Journal::full() {
+    return start != 0 && tx.size() + (active + 1) * JOURNAL_OP_BLOCKS > max_tx() / 2;
+}
+
+void Journal::set_group(unsigned ops, unsigned delay_ms) {
+    std::lock_guard<std::mutex> l(lock);
+    group_ops = ops;
+    group_delay = std::chrono::milliseconds(delay_ms);
+}
+
+void Journal::get_group(unsigned *ops, unsigned *delay_ms) {
+    std::lock_guard<std::mutex> l(lock);
+    *ops = group_ops;
+    *delay_ms = group_delay.count();
+}
+
+int Journal::begin_op() {
+    std::unique_lock<std::mutex> l(lock);
+    // a complete group is committed once the operations in it are done,
+    // and an operation waits until there is room for it
+    while (group_done() || full()) {
+        if (active == 0) {
+            if (commit_locked())
+                return -1;
+            break;
+        }
+        idle.wait(l);
+    }
+    if (tx.empty()) {
+        ops = 0;
+        first_op = std::chrono::steady_clock::now();
+    }
+    ops++;
+    active++;
+    return 0;
+}
+
+void Journal::end_op() {
+    std::lock_guard<std::mutex> l(lock);
+    active--;
+    idle.notify_all();
+}
+
+int Journal::add(unsigned block_no) {
+    std::lock_guard<std::mutex> l(lock);
+    if (start == 0)
+        return 0;
+    int ret = cache.pin(block_no);
+    if (ret < 0)
+        return -1;
+    if (ret == 1) {
+        tx.push_back(block_no);
+        if (tx.size() == 1)
+            started.notify_one();
+        // begin_op() leaves half of max_tx() to spare, only an operation
+        // that changes more than that by itself gets here. It is
+        // committed in parts.
+        if (tx.size() >= max_tx())
+            return commit_locked();
+    }
+    return 0;
+}
+
+// Background thread: commits a transaction once its first operation is
+// older than group_delay and no operation is half done
+void Journal::commit_late() {
+    std::unique_lock<std::mutex> l(lock);
+    while (!stop) {
+        if (tx.empty()) {
+            started.wait(l);
+        } else if (std::chrono::steady_clock::now() < first_op + group_delay) {
+            started.wait_until(l, first_op + group_delay);
+        } else if (active > 0) {
+            idle.wait(l);
+        } else if (commit_locked()) {
+            // try again later
+            started.wait_for(l, group_delay);
+        }
+    }
+}
+
+// waits until no operation is half done and commits
+int Journal::commit() {
+    std::unique_lock<std::mutex> l(lock);
+    idle.wait(l, [&] { return active == 0; });
+    return commit_locked();
+}
+
+int Journal::commit_locked() {
+    if (tx.empty())
+        return 0;
+
+    // descriptor, the changed ranges of the blocks packed back to back
+    // (or the whole blocks), and the commit block
+    uint8_t desc_block[BLOCK_SIZE];
+    descriptor *desc = (descriptor*)desc_block;
+    std::vector<uint8_t> data;
+    auto pack = [&](bool whole) {
+        std::memset(desc_block, 0, BLOCK_SIZE);
+        desc->magic = JOURNAL_MAGIC;
+        desc->seq = seq;
+        data.clear();
+        for (unsigned block_no : tx) {
+            unsigned lo, hi;
+            if (cache.dirty_range(block_no, &lo, &hi))
+                continue;
+            if (whole) {
+                lo = 0;
+                hi = BLOCK_SIZE;
+            } else if (lo >= hi) {
+                continue;
+            }
+            desc->ranges[desc->count++] = {block_no, (uint16_t)lo, (uint16_t)(hi - lo)};
+            uint8_t blk[BLOCK_SIZE];
+            cache.peek(block_no, blk);
+            data.insert(data.end(), blk + lo, blk + hi);
+        }
+        desc->data = (data.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        data.resize(desc->data * BLOCK_SIZE);
+    };
+    pack(false);
+
+    // A transaction larger than the rest of the log starts it over, once
+    // the committed ones are home. The blocks of this one stay pinned, so
+    // the changes committed to them before are not home, and they are
+    // logged whole. max_tx() leaves room for that.
+    if (head + desc->data + 2 > size - 1) {
+        if (cache.sync() || reset())
+            return -1;
+        checkpoints++;
+        pack(true);
+    }
+
+    std::vector<disk_iovec> iov;
+    for (unsigned i = 0; i < desc->data; i++)
+        iov.push_back({start + 2 + head + i, &data[i * BLOCK_SIZE], 0});
+    uint8_t commit[BLOCK_SIZE] = {0};
+    commit_block *c = (commit_block*)commit;
+    c->magic = COMMIT_MAGIC;
+    c->seq = seq;
+    c->data = desc->data;
+    c->checksum = checksum(desc_block, iov);
+    iov.insert(iov.begin(), disk_iovec{start + 1 + head, desc_block, 0});
+    iov.push_back(disk_iovec{start + 2 + head + desc->data, commit, 0});
+
+    // data blocks written since the last commit must be on the disk
+    // before the log that points at them, so they are synced first
+    // (unless nothing was written since the last commit). A second sync
+    // makes the log durable.
+    if (cache.flush())
+        return -1;
+    if (disk.get_blocks_written() != synced && disk.sync())
+        return -1;
+    if (disk.writev(iov) || disk.sync())
+        return -1;
+    synced = disk.get_blocks_written();
+    commits++;
+
+    head += desc->data + 2;
+    seq++;
+    tx.clear();
+    ops = 0;
+    cache.unpin_all();
+
+    // checkpoint when there is no room left for a transaction of the
+    // size begin_op() admits
+    if (size - 1 - head < max_tx() / 2 + 2)
+        return checkpoint_locked();
+    return 0;
+}
+
+int Journal::checkpoint() {
+    std::unique_lock<std::mutex> l(lock);
+    idle.wait(l, [&] { return active == 0; });
+    return checkpoint_locked();
+}
+
+int Journal::checkpoint_locked() {
+    if (start == 0)
+        return cache.sync();
+    if (commit_locked())
+        return -1;
+    if (head == 0)
+        return cache.sync();
+    if (cache.sync())
+        return -1;
+    checkpoints++;
+    return reset();
+}
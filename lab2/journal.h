@@ -0,0 +1,150 @@
+#include <iostream>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "disk.h"
+#include "cache.h"
+
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+// a transaction is committed when it has this many operations, or when
+// its first operation is older than JOURNAL_DELAY_MS
+#define JOURNAL_GROUP 16
+#define JOURNAL_DELAY_MS 50
+// blocks an operation is expected to add to a transaction, see begin_op()
+#define JOURNAL_OP_BLOCKS 8
+
+#define JOURNAL_MAGIC 0x4a524e4c // "JRNL"
+#define COMMIT_MAGIC 0x434d4954  // "CMIT"
+
+// Write-ahead journal for metadata blocks. Metadata blocks changed by an
+// operation are pinned in the cache and added to the running transaction.
+// A commit syncs the data written since the last one, then writes a
+// descriptor block, the changed byte range of each block packed into as
+// few log blocks as possible and a commit block with a checksum to the
+// log, and syncs the disk again. After that the blocks are unpinned and
+// reach their home locations through the normal cache write-back. When
+// the log is half full it is checkpointed: all dirty blocks are written
+// home and the log starts over.
+//
+// Log layout: block 0 of the region is a header with the sequence number
+// of the first transaction in the log, transactions follow back to back.
+//
+// A background thread commits the running transaction when its first
+// operation is older than the group delay, so a change does not wait for
+// the next operation to be committed.
+//
+// Operations may run in several threads at once. Every operation is
+// bracketed by begin_op()/end_op() (see journal_op), and a transaction is
+// only committed when no operation is half done. An operation only starts
+// when the running transaction has room for JOURNAL_OP_BLOCKS more blocks
+// for it and each running operation within half of max_tx(). The other
+// half is left for operations that change more, so only an operation
+// larger than that by itself is committed in parts.
+class Journal {
+private:
+    struct header {
+        uint32_t magic;
+        uint32_t seq;
+    };
+    // changed bytes [offset, offset + len) of a block
+    struct range {
+        uint32_t block_no;
+        uint16_t offset;
+        uint16_t len;
+    };
+    struct descriptor {
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t count;     // ranges
+        uint32_t data;      // log blocks holding the packed ranges
+        range ranges[(BLOCK_SIZE - 16) / sizeof(range)];
+    };
+    struct commit_block {
+        uint32_t magic;
+        uint32_t seq;
+        uint32_t data;
+        uint32_t checksum;
+    };
+    Disk &disk;
+    Cache &cache;
+    unsigned start;     // first block of the journal region
+    unsigned size;      // blocks in the region
+    unsigned head;      // next free log block, relative to start + 1
+    uint32_t seq;       // sequence number of the running transaction
+    std::vector<unsigned> tx;   // blocks of the running transaction
+    unsigned ops;               // operations in the running transaction
+    unsigned group_ops;         // see set_group()
+    std::chrono::milliseconds group_delay;
+    std::chrono::steady_clock::time_point first_op;
+    unsigned long commits;
+    unsigned long checkpoints;
+    unsigned long synced;   // blocks written to the disk at the last commit
+    std::mutex lock;
+    std::condition_variable idle;   // signalled when an operation ends
+    unsigned active;                // operations between begin and end
+    std::thread committer;
+    std::condition_variable started;    // a transaction got its first block
+    bool stop;
+    void commit_late();
+    unsigned max_tx();
+    bool group_done();
+    bool full();
+    int commit_locked();
+    int checkpoint_locked();
+    uint32_t checksum(const uint8_t *desc, const std::vector<disk_iovec>& iov);
+    int write_header();
+public:
+    Journal(Disk &disk, Cache &cache);
+    ~Journal();
+    // sets the journal region, start 0 disables journaling
+    void init(unsigned start, unsigned size);
+    // applies the committed transactions found in the log and empties it
+    int replay();
+    // empties the log, all blocks must be at their home locations
+    int reset();
+    // starts an operation, committing the running transaction first if
+    // its group is complete
+    int begin_op();
+    // ends an operation started by begin_op()
+    void end_op();
+    // adds a cached block to the running transaction
+    int add(unsigned block_no);
+    // commits a transaction when it has ops operations or its first
+    // operation is older than delay_ms, JOURNAL_GROUP and JOURNAL_DELAY_MS
+    // by default
+    void set_group(unsigned ops, unsigned delay_ms);
+    // the setting made by set_group()
+    void get_group(unsigned *ops, unsigned *delay_ms);
+    // writes the running transaction to the log
+    int commit();
+    // commits and writes every dirty block home, then empties the log
+    int checkpoint();
+    // the running transaction, changes added now are on the disk once
+    // committed() is true for it
+    unsigned long current_tx() { std::lock_guard<std::mutex> l(lock); return commits; }
+    bool committed(unsigned long tx) { std::lock_guard<std::mutex> l(lock); return start == 0 || tx < commits; }
+    unsigned long get_commits() { std::lock_guard<std::mutex> l(lock); return commits; }
+    unsigned long get_checkpoints() { std::lock_guard<std::mutex> l(lock); return checkpoints; }
+};
+
+// keeps an operation of the journal open for its lifetime
+class journal_op {
+private:
+    Journal &journal;
+    int status;
+public:
+    explicit journal_op(Journal &journal) : journal(journal) { status = journal.begin_op(); }
+    ~journal_op() { if (status == 0) journal.end_op(); }
+    journal_op(const journal_op&) = delete;
+    journal_op& operator=(const journal_op&) = delete;
+    // -1 if the operation could not be started
+    int failed() { return status; }
+};
+
+#endif // __JOURNAL_H__
@@ -0,0 +1,35 @@
+#include <pthread.h>
+
+
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
+// Reader/writer lock. C++11 has no shared mutex, so this wraps a pthread
+// rwlock. lock()/unlock() take it exclusively and work with
+// std::lock_guard, lock_shared()/unlock_shared() with shared_guard.
+class rw_lock {
+private:
+    pthread_rwlock_t rwlock;
+public:
+    rw_lock() { pthread_rwlock_init(&rwlock, nullptr); }
+    ~rw_lock() { pthread_rwlock_destroy(&rwlock); }
+    rw_lock(const rw_lock&) = delete;
+    rw_lock& operator=(const rw_lock&) = delete;
+    void lock() { pthread_rwlock_wrlock(&rwlock); }
+    void unlock() { pthread_rwlock_unlock(&rwlock); }
+    void lock_shared() { pthread_rwlock_rdlock(&rwlock); }
+    void unlock_shared() { pthread_rwlock_unlock(&rwlock); }
+};
+
+// holds an rw_lock shared for its lifetime
+class shared_guard {
+private:
+    rw_lock &l;
+public:
+    explicit shared_guard(rw_lock &l) : l(l) { l.lock_shared(); }
+    ~shared_guard() { l.unlock_shared(); }
+    shared_guard(const shared_guard&) = delete;
+    shared_guard& operator=(const shared_guard&) = delete;
+};
+
+#endif // __LOCK_H__
@@ -0,0 +1,75 @@
+#include <cstdint>
+
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+// Binary protocol of the file system server (see Server), over a Unix
+// domain stream socket. Numbers are in host byte order, client and server
+// run on the same machine.
+//
+// A request is a request_header followed by length bytes holding argc
+// arguments, each a uint32_t byte count and the bytes. Paths and names
+// are arguments without a terminating zero, offsets and lengths are
+// 4-byte arguments holding a uint32_t. The server answers every request,
+// in order, with a response_header followed by length bytes of data.
+// OP_CAT is answered in parts: responses with status 1 and at most
+// CAT_PART bytes of the file each, then one with no data and the status.
+//
+// op           arguments               status / data
+// OP_FORMAT                            0 or -1
+// OP_CREATE    path, content           0 or -1
+// OP_CAT       path                    0 or -1 / content of the file, in parts
+// OP_LS                                0 or -1 / dir_entry per entry
+// OP_CP        source, dest            0 or -1
+// OP_MV        source, dest            0 or -1
+// OP_RM        path                    0 or -1
+// OP_APPEND    path1, path2            0 or -1
+// OP_MKDIR     path                    0 or -1
+// OP_CD        path                    0 or -1
+// OP_PWD                               0 / working directory
+// OP_CHMOD     rights, path            0 or -1
+// OP_SYNC                              0 or -1
+// OP_PREAD     path, offset, len       bytes read or -1 / the bytes
+// OP_PWRITE    path, offset, data      bytes written or -1
+// OP_SHUTDOWN                          0, then the server stops
+//
+// Each connection is a session with its own working directory, starting
+// at the root.
+#define OP_FORMAT 1
+#define OP_CREATE 2
+#define OP_CAT 3
+#define OP_LS 4
+#define OP_CP 5
+#define OP_MV 6
+#define OP_RM 7
+#define OP_APPEND 8
+#define OP_MKDIR 9
+#define OP_CD 10
+#define OP_PWD 11
+#define OP_CHMOD 12
+#define OP_SYNC 13
+#define OP_PREAD 14
+#define OP_PWRITE 15
+#define OP_SHUTDOWN 16
+
+// largest request payload the server accepts, a header announcing a
+// bigger one closes the connection. Larger files are written with
+// OP_PWRITE in parts.
+#define MAX_REQUEST (1u << 20)
+// largest part of a file in one response to OP_CAT
+#define CAT_PART (1u << 20)
+
+struct request_header {
+    uint32_t length;    // bytes of arguments after the header
+    uint8_t op;
+    uint8_t argc;
+    uint16_t reserved;
+};
+
+struct response_header {
+    uint32_t length;    // bytes of data after the header
+    int32_t status;
+};
+
+#endif // __PROTOCOL_H__
@@ -0,0 +1,486 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "server.h"
+
+
+Server::Server(FS &fs) : fs(fs)
+{
+    listen_fd = -1;
+    epoll_fd = -1;
+    wake_fd = -1;
+    stopping = false;
+    workers_stop = false;
+}
+
+Server::~Server()
+{
+    for (auto &kv : connections)
+        ::close(kv.first);
+    if (listen_fd >= 0)
+        ::close(listen_fd);
+    if (epoll_fd >= 0)
+        ::close(epoll_fd);
+    if (wake_fd >= 0)
+        ::close(wake_fd);
+}
+
+int Server::run(const std::string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Server: socket path too long\n";
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // a socket left behind by an earlier server is replaced
+    unlink(path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) ||
+        listen(listen_fd, SOMAXCONN)) {
+        std::cerr << "Server: can't listen on " << path << ": " << strerror(errno) << "\n";
+        return -1;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0)
+        return -1;
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    stopping = false;
+    workers_stop = false;
+    for (int i = 0; i < SERVER_THREADS; i++)
+        workers.emplace_back(&Server::worker, this);
+
+    epoll_event events[SERVER_EVENTS];
+    while (true) {
+        if (stopping) {
+            // let the running requests finish, close everything else
+            std::vector<int> idle;
+            for (auto &kv : connections) {
+                if (!kv.second.busy)
+                    idle.push_back(kv.first);
+            }
+            for (int fd : idle) {
+                flush(connections[fd]);
+                close_connection(fd);
+            }
+            if (connections.empty())
+                break;
+        }
+        int n = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_all();
+                continue;
+            }
+            if (fd == wake_fd) {
+                finish();
+                continue;
+            }
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            connection &c = it->second;
+            if (events[i].events & (EPOLLHUP | EPOLLERR))
+                c.closing = true;   // the client is gone, even with input left
+            else if (events[i].events & EPOLLIN)
+                receive(c);
+            if (!c.closing && (events[i].events & EPOLLOUT))
+                flush(c);
+            if (c.closing && !c.busy)
+                close_connection(fd);
+            else
+                dispatch(c);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> l(lock);
+        workers_stop = true;
+    }
+    queued.notify_all();
+    for (auto &t : workers)
+        t.join();
+    workers.clear();
+    ::close(listen_fd);
+    listen_fd = -1;
+    unlink(path.c_str());
+    return 0;
+}
+
+void Server::accept_all() {
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        if (stopping) {
+            ::close(fd);
+            continue;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            ::close(fd);
+            continue;
+        }
+        connection &c = connections[fd];
+        c.fd = fd;
+        // a session of no mount starts in the root directory
+        c.session = fs_session{0, "/", 0, 0, cwd_ref()};
+        c.in.clear();
+        c.out.clear();
+        c.sent = 0;
+        c.busy = false;
+        c.closing = false;
+        c.cat_fd = -1;
+        c.cat_offset = 0;
+    }
+}
+
+// Reads what the client has sent, up to SERVER_MAX_INPUT bytes. End of
+// file, an error or a request longer than MAX_REQUEST closes the
+// connection once its running request is done.
+void Server::receive(connection& c) {
+    uint8_t buf[65536];
+    while (c.in.size() < SERVER_MAX_INPUT) {
+        ssize_t n = ::read(c.fd, buf, std::min(sizeof(buf), SERVER_MAX_INPUT - c.in.size()));
+        if (n > 0) {
+            c.in.insert(c.in.end(), buf, buf + n);
+            request_header h;
+            if (c.in.size() >= sizeof(h)) {
+                std::memcpy(&h, c.in.data(), sizeof(h));
+                if (h.length > MAX_REQUEST) {
+                    c.closing = true;
+                    return;
+                }
+            }
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        c.closing = true;
+        return;
+    }
+    // full, epoll stops reporting input until dispatch() makes room
+    watch(c);
+}
+
+// Hands the next complete request of the connection to the workers
+void Server::dispatch(connection& c) {
+    if (c.busy || c.closing || stopping || c.sent < c.out.size())
+        return;
+    job j;
+    j.fd = c.fd;
+    j.session = c.session;
+    j.cat_fd = -1;
+    j.cat_offset = 0;
+    if (c.cat_fd >= 0) {
+        // the next part of a cat, once the last one is sent
+        j.op = OP_CAT;
+        j.cat_fd = c.cat_fd;
+        j.cat_offset = c.cat_offset;
+        c.cat_fd = -1;
+        queue(c, j);
+        return;
+    }
+    request_header h;
+    if (c.in.size() < sizeof(h))
+        return;
+    std::memcpy(&h, c.in.data(), sizeof(h));
+    if (h.length > MAX_REQUEST) {
+        c.closing = true;
+        return;
+    }
+    if (c.in.size() - sizeof(h) < h.length)
+        return;
+
+    j.op = h.op;
+    size_t pos = sizeof(h);
+    size_t end = sizeof(h) + h.length;
+    for (int i = 0; i < h.argc; i++) {
+        uint32_t len;
+        if (end - pos < sizeof(len)) {
+            c.closing = true;
+            return;
+        }
+        std::memcpy(&len, &c.in[pos], sizeof(len));
+        pos += sizeof(len);
+        if (end - pos < len) {
+            c.closing = true;
+            return;
+        }
+        j.args.emplace_back((const char*)&c.in[pos], len);
+        pos += len;
+    }
+    bool full = c.in.size() >= SERVER_MAX_INPUT;
+    c.in.erase(c.in.begin(), c.in.begin() + end);
+    if (full)
+        watch(c);
+    queue(c, j);
+}
+
+// Hands a job of the connection to the workers
+void Server::queue(connection& c, job& j) {
+    c.busy = true;
+    {
+        std::lock_guard<std::mutex> l(lock);
+        jobs.push_back(std::move(j));
+    }
+    queued.notify_one();
+}
+
+// Queues the responses of the finished jobs and starts the next requests
+void Server::finish() {
+    uint64_t count;
+    if (::read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+    std::deque<job> finished;
+    {
+        std::lock_guard<std::mutex> l(lock);
+        finished.swap(done);
+    }
+    for (auto &j : finished) {
+        connection &c = connections[j.fd];
+        c.busy = false;
+        c.session = j.session;
+        c.cat_fd = j.cat_fd;
+        c.cat_offset = j.cat_offset;
+        c.out.insert(c.out.end(), j.response.begin(), j.response.end());
+        if (j.op == OP_SHUTDOWN)
+            stopping = true;
+        if (!c.closing)
+            flush(c);
+        if (c.closing)
+            close_connection(j.fd);
+        else
+            dispatch(c);
+    }
+}
+
+// Sends as much of the pending output as the socket takes, and asks for
+// EPOLLOUT while some is left
+int Server::flush(connection& c) {
+    while (c.sent < c.out.size()) {
+        ssize_t n = send(c.fd, &c.out[c.sent], c.out.size() - c.sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0) {
+            c.closing = true;
+            return -1;
+        }
+        c.sent += n;
+    }
+    if (c.sent == c.out.size()) {
+        c.out.clear();
+        c.sent = 0;
+    }
+    watch(c);
+    return 0;
+}
+
+// Asks epoll for input while the connection has room for it, and for
+// EPOLLOUT while some output is left
+void Server::watch(connection& c) {
+    epoll_event ev = {};
+    ev.events = 0;
+    if (c.in.size() < SERVER_MAX_INPUT)
+        ev.events |= EPOLLIN;
+    if (!c.out.empty())
+        ev.events |= EPOLLOUT;
+    ev.data.fd = c.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void Server::close_connection(int fd) {
+    connection &c = connections[fd];
+    if (c.cat_fd >= 0)
+        fs.close(c.cat_fd);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    connections.erase(fd);
+}
+
+void Server::worker() {
+    while (true) {
+        job j;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            queued.wait(l, [&] { return workers_stop || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            j = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        execute(j);
+        {
+            std::lock_guard<std::mutex> l(lock);
+            done.push_back(std::move(j));
+        }
+        uint64_t one = 1;
+        if (::write(wake_fd, &one, sizeof(one)) < 0)
+            std::cerr << "Server: can't wake the event loop\n";
+    }
+}
+
+// Runs one request in the session of its connection and builds the
+// response
+void Server::execute(job& j) {
+    fs.set_session(j.session);
+    if (j.op == OP_CAT) {
+        cat_part(j);
+        j.session = fs.get_session();
+        return;
+    }
+    int32_t status = -1;
+    std::vector<uint8_t> data;
+    const std::vector<std::string> &a = j.args;
+    // 4-byte number arguments
+    auto number = [&](size_t i) {
+        uint32_t n = 0;
+        std::memcpy(&n, a[i].data(), std::min(a[i].size(), sizeof(n)));
+        return n;
+    };
+
+    try {
+        switch (j.op) {
+        case OP_FORMAT:
+            if (a.size() == 0) status = fs.format();
+            break;
+        case OP_CREATE:
+            if (a.size() == 2) status = fs.create(a[0], a[1].data(), a[1].size());
+            break;
+        case OP_LS:
+            if (a.size() == 0) {
+                std::vector<dir_entry> entries;
+                status = fs.list(entries);
+                if (status == 0) {
+                    data.resize(entries.size() * sizeof(dir_entry));
+                    if (!entries.empty())
+                        std::memcpy(data.data(), entries.data(), data.size());
+                }
+            }
+            break;
+        case OP_CP:
+            if (a.size() == 2) status = fs.cp(a[0], a[1]);
+            break;
+        case OP_MV:
+            if (a.size() == 2) status = fs.mv(a[0], a[1]);
+            break;
+        case OP_RM:
+            if (a.size() == 1) status = fs.rm(a[0]);
+            break;
+        case OP_APPEND:
+            if (a.size() == 2) status = fs.append(a[0], a[1]);
+            break;
+        case OP_MKDIR:
+            if (a.size() == 1) status = fs.mkdir(a[0]);
+            break;
+        case OP_CD:
+            if (a.size() == 1) status = fs.cd(a[0]);
+            break;
+        case OP_PWD:
+            if (a.size() == 0) {
+                std::string path = fs.get_session().path;
+                data.assign(path.begin(), path.end());
+                status = 0;
+            }
+            break;
+        case OP_CHMOD:
+            if (a.size() == 2) status = fs.chmod(a[0], a[1]);
+            break;
+        case OP_SYNC:
+            if (a.size() == 0) status = fs.sync();
+            break;
+        case OP_PREAD:
+            if (a.size() == 3) {
+                uint32_t len = std::min(number(2), MAX_REQUEST);
+                data.resize(len);
+                status = fs.pread(a[0], number(1), len, data.data());
+                data.resize(status > 0 ? status : 0);
+            }
+            break;
+        case OP_PWRITE:
+            if (a.size() == 3) status = fs.pwrite(a[0], number(1), a[2].size(), a[2].data());
+            break;
+        case OP_SHUTDOWN:
+            status = 0;
+            break;
+        }
+    } catch (const std::exception& e) {
+        // e.g. chmod with rights that are not a number
+        status = -1;
+        data.clear();
+    }
+    j.session = fs.get_session();
+
+    response_header h = {(uint32_t)data.size(), status};
+    j.response.resize(sizeof(h) + data.size());
+    std::memcpy(j.response.data(), &h, sizeof(h));
+    if (!data.empty())
+        std::memcpy(&j.response[sizeof(h)], data.data(), data.size());
+}
+
+// Runs one part of a cat: opens the file for the first part, then sends
+// up to CAT_PART bytes of it. The last part is followed by the status and
+// closes the file.
+void Server::cat_part(job& j) {
+    std::vector<uint8_t> data;
+    int32_t status = -1;
+    if (j.cat_fd < 0 && j.args.size() == 1) {
+        j.cat_fd = fs.open(j.args[0]);
+        j.cat_offset = 0;
+    }
+    if (j.cat_fd >= 0) {
+        data.resize(CAT_PART);
+        int n = fs.pread(j.cat_fd, j.cat_offset, CAT_PART, data.data());
+        data.resize(n > 0 ? n : 0);
+        if (n >= 0)
+            j.cat_offset += n;
+        if (n == (int)CAT_PART) {
+            status = 1;
+        } else {
+            status = n < 0 ? -1 : 0;
+            fs.close(j.cat_fd);
+            j.cat_fd = -1;
+        }
+    }
+
+    response_header h = {(uint32_t)data.size(), 1};
+    j.response.resize(sizeof(h) + data.size());
+    std::memcpy(j.response.data(), &h, sizeof(h));
+    if (!data.empty())
+        std::memcpy(&j.response[sizeof(h)], data.data(), data.size());
+    if (status != 1) {
+        // the end: the status in a response of its own
+        if (data.empty())
+            j.response.clear();
+        response_header end = {0, status};
+        size_t pos = j.response.size();
+        j.response.resize(pos + sizeof(end));
+        std::memcpy(&j.response[pos], &end, sizeof(end));
+    }
+}
@@ -0,0 +1,87 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "fs.h"
+#include "protocol.h"
+
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+// threads running the requests of the clients
+#define SERVER_THREADS 4
+// events taken from epoll at a time
+#define SERVER_EVENTS 64
+// received bytes kept for a connection, reading it stops there until a
+// request is taken out
+#define SERVER_MAX_INPUT (sizeof(request_header) + MAX_REQUEST)
+
+// Serves one mounted FS to many clients over a Unix domain socket, with
+// the protocol in protocol.h. One thread runs an epoll loop that accepts
+// connections, reads requests and writes responses without blocking.
+// Complete requests go to SERVER_THREADS worker threads, which run them
+// on the FS in the session of their connection. A connection has at most
+// one request running, so its responses come in order, and no new request
+// is started until the previous response has been sent. A cat is sent a
+// part at a time in the same way, the connection keeps the file open
+// between the parts.
+class Server {
+private:
+    struct connection {
+        int fd;
+        fs_session session;
+        std::vector<uint8_t> in;    // received bytes not handled yet
+        std::vector<uint8_t> out;   // response bytes not sent yet
+        size_t sent;                // bytes of out already sent
+        bool busy;                  // a request is with a worker
+        bool closing;               // close once the request is done
+        int cat_fd;                 // FS descriptor of a cat not sent yet, or -1
+        uint32_t cat_offset;        // where its next part starts
+    };
+    // a request on its way to a worker and back with the response
+    struct job {
+        int fd;
+        fs_session session;
+        uint8_t op;
+        std::vector<std::string> args;
+        std::vector<uint8_t> response;
+        int cat_fd;             // see connection, -1 when the cat is done
+        uint32_t cat_offset;
+    };
+    FS &fs;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;    // eventfd, signalled when a job is done
+    bool stopping;
+    std::unordered_map<int, connection> connections;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable queued;
+    std::deque<job> jobs;
+    std::deque<job> done;
+    bool workers_stop;
+    void worker();
+    void execute(job& j);
+    void accept_all();
+    void receive(connection& c);
+    void dispatch(connection& c);
+    void queue(connection& c, job& j);
+    void cat_part(job& j);
+    void finish();
+    int flush(connection& c);
+    void watch(connection& c);
+    void close_connection(int fd);
+public:
+    Server(FS &fs);
+    ~Server();
+    // serves clients on the socket path until a client sends OP_SHUTDOWN.
+    // Returns -1 if the socket can not be set up.
+    int run(const std::string& path);
+};
+
+#endif // __SERVER_H__
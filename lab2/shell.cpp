@@ -1,252 +1,315 @@
 #include <iostream>
-#include <sstream>
 #include <string>
-#include <vector>
+#include <cstring>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "shell.h"
 #include "fs.h"
+#include "server.h"
+
+// words of a command line that are kept, longer lines are only counted
+#define MAX_WORDS 4
+// a batch commits its metadata every BATCH_GROUP commands, or when the
+// oldest change is BATCH_DELAY_MS old
+#define BATCH_GROUP 1024
+#define BATCH_DELAY_MS 1000
 
 std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
+    "chmod", "sync", "import", "serve", "batch", "stats",
     "help", "quit"
 };
 
-Shell::Shell()
-{
-    std::cout << "Starting shell...\n";
+// a word of a command line, pointing into the line
+struct word {
+    const char *data;
+    size_t len;
+    std::string str() const { return std::string(data, len); }
+};
+
+struct command_line {
+    word words[MAX_WORDS];
+    unsigned count;     // words on the line, words[0] is the command
+};
+
+// where the commands are read from: the rest of a batch file, or stdin
+// when pos is nullptr
+struct shell_input {
+    const char *pos;
+    const char *end;
+    bool running;       // cleared by quit
+};
+
+struct shell_command {
+    const char *name;
+    unsigned args;
+    const char *usage;
+    int (*run)(FS& fs, const command_line& cmd, shell_input& in);
+};
+
+static int run_batch(FS& fs, const std::string& path);
+
+// splits [p, end) into words separated by white space, so a \r of a
+// CRLF line or a tab is not part of a word
+static void split(const char *p, const char *end, command_line& cmd) {
+    cmd.count = 0;
+    while (p < end) {
+        if (isspace((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        const char *start = p;
+        while (p < end && !isspace((unsigned char)*p))
+            p++;
+        if (cmd.count < MAX_WORDS)
+            cmd.words[cmd.count] = word{start, (size_t)(p - start)};
+        cmd.count++;
+    }
 }
 
-Shell::~Shell()
-{
-    std::cout << "Exiting shell...\n";
+static int do_format(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.format();
 }
 
-void
-Shell::run()
-{
-    bool running = true;
-    std::string line;
-    std::string str;
-    char c;
-    std::vector<std::string> cmd_line;
-    std::string cmd, arg1, arg2;
-    int ret_val = 0;
-    while (running) {
-        std::cout << "filesystem> ";
-        std::getline(std::cin, line);
-        std::stringstream linestream(line);
-        cmd_line.clear();
-        str.clear();
-        while (linestream.get(c)) {
-            //std::cout << "parsing cmd line: " << c << "\n";
-            if (c != ' ') {
-                str += c;
-            } else {
-                // strip multiple blanks
-                if (!str.empty()) {
-                    cmd_line.push_back(str);
-                    str.clear();
-                }
-            }
-        }
-        if (!str.empty())
-            cmd_line.push_back(str);
-        if (line.empty())
-            cmd = "";
-        else
-            cmd = cmd_line[0];
+static int do_create(FS& fs, const command_line& cmd, shell_input& in) {
+    if (!in.pos) {
+        std::cout << "Enter data. Empty line to end.\n";
+        return fs.create(cmd.words[1].str());
+    }
+    // the content is the following lines of the batch up to an empty
+    // line, and is already laid out as the file
+    const char *start = in.pos;
+    while (in.pos < in.end && *in.pos != '\n') {
+        const char *nl = (const char*)memchr(in.pos, '\n', in.end - in.pos);
+        in.pos = nl ? nl + 1 : in.end;
+    }
+    const char *stop = in.pos;
+    if (in.pos < in.end)
+        in.pos++;
+    return fs.create(cmd.words[1].str(), start, stop - start);
+}
 
-        if (DEBUG) {
-            std::cout << "Line: " << line << std::endl;
-            std::cout << "cmd: " << cmd << std::endl;
-            for (unsigned i = 0; i < cmd_line.size(); ++i)
-                std::cout << "cmd/arg: " << cmd_line[i] << "\n";
-        }
+static int do_cat(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.cat(cmd.words[1].str());
+}
 
-        if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.format();
-            if (ret_val) {
-                std::cout << "Error: format failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_ls(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.ls();
+}
 
-        else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            std::cout << "Enter data. Empty line to end.\n";
-            // check return value so everything is ok
-            ret_val = filesystem.create(arg1);
-            if (ret_val) {
-                std::cout << "Error: create " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_cp(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.cp(cmd.words[1].str(), cmd.words[2].str());
+}
 
-        else if (cmd == "cat") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
-            if (ret_val) {
-                std::cout << "Error: cat " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_mv(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.mv(cmd.words[1].str(), cmd.words[2].str());
+}
 
-        else if (cmd == "ls") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.ls();
-            if (ret_val) {
-                std::cout << "Error: ls failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_rm(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.rm(cmd.words[1].str());
+}
 
-        else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: cp " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_append(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.append(cmd.words[1].str(), cmd.words[2].str());
+}
 
-        else if (cmd == "mv") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: mv <sourcepath> <destpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.mv(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: mv " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_mkdir(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.mkdir(cmd.words[1].str());
+}
 
-        else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
-            if (ret_val) {
-                std::cout << "Error: rm " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_cd(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.cd(cmd.words[1].str());
+}
 
-        else if (cmd == "append") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: append <filepath1> <filepath2>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.append(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: append " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_pwd(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.pwd();
+}
 
-        else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
-            if (ret_val) {
-                std::cout << "Error: mkdir " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_chmod(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.chmod(cmd.words[1].str(), cmd.words[2].str());
+}
 
-        else if (cmd == "cd") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cd <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cd(arg1);
-            if (ret_val) {
-                std::cout << "Error: cd " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_sync(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.sync();
+}
 
-        else if (cmd == "pwd") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: pwd\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.pwd();
-            if (ret_val) {
-                std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_import(FS& fs, const command_line& cmd, shell_input& in) {
+    std::string hostfile = cmd.words[1].str();
+    int fd = open(hostfile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Error: can't open " << hostfile << std::endl;
+        return -1;
+    }
+    int ret_val = fs.import(fd, cmd.words[2].str());
+    close(fd);
+    return ret_val;
+}
 
-        else if (cmd == "chmod") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: chmod <accessrights> <filepath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.chmod(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: chmod " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
-        }
+static int do_serve(FS& fs, const command_line& cmd, shell_input& in) {
+    // serves clients until one of them sends a shutdown request
+    Server server(fs);
+    return server.run(cmd.words[1].str());
+}
+
+static int do_batch(FS& fs, const command_line& cmd, shell_input& in) {
+    return run_batch(fs, cmd.words[1].str());
+}
+
+static int do_stats(FS& fs, const command_line& cmd, shell_input& in) {
+    return fs.stats();
+}
 
-        else if (cmd == "quit")
-            running = false;
+static int do_help(FS& fs, const command_line& cmd, shell_input& in) {
+    std::cout << "Available commands:\n";
+    std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, import, serve, batch, stats, help, quit\n";
+    return 0;
+}
+
+static int do_quit(FS& fs, const command_line& cmd, shell_input& in) {
+    in.running = false;
+    return 0;
+}
 
-        else if (cmd == "help") {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+static const shell_command commands[] = {
+    {"format", 0, "format", do_format},
+    {"create", 1, "create <file>", do_create},
+    {"cat", 1, "cat <file>", do_cat},
+    {"ls", 0, "ls", do_ls},
+    {"cp", 2, "<oldfile> <newfile>", do_cp},
+    {"mv", 2, "mv <sourcepath> <destpath>", do_mv},
+    {"rm", 1, "rm <file>", do_rm},
+    {"append", 2, "append <filepath1> <filepath2>", do_append},
+    {"mkdir", 1, "mkdir <dirpath>", do_mkdir},
+    {"cd", 1, "cd <dirpath>", do_cd},
+    {"pwd", 0, "pwd", do_pwd},
+    {"chmod", 2, "chmod <accessrights> <filepath>", do_chmod},
+    {"sync", 0, "sync", do_sync},
+    {"import", 2, "import <hostfile> <file>", do_import},
+    {"serve", 1, "serve <socket>", do_serve},
+    {"batch", 1, "batch <commandfile>", do_batch},
+    {"stats", 0, "stats", do_stats},
+    {"help", 0, "help", do_help},
+    {"quit", 0, "quit", do_quit},
+};
+
+// Runs one command line. Returns the status of the command, -1 for an
+// unknown command or bad usage.
+static int execute(FS& fs, const command_line& cmd, shell_input& in) {
+    const word& name = cmd.words[0];
+    const shell_command *c = nullptr;
+    for (const auto& command : commands) {
+        if (strlen(command.name) == name.len && !memcmp(command.name, name.data, name.len)) {
+            c = &command;
+            break;
         }
+    }
+    if (!c) {
+        do_help(fs, cmd, in);
+        return -1;
+    }
+    if (cmd.count != c->args + 1) {
+        std::cout << "Usage: " << c->usage << "\n";
+        return -1;
+    }
+    // check return value so everything is ok
+    int ret_val = c->run(fs, cmd, in);
+    if (ret_val) {
+        std::cout << "Error: " << c->name;
+        for (unsigned i = 1; i < cmd.count; i++)
+            std::cout << " " << cmd.words[i].str();
+        std::cout << " failed, error code " << ret_val << std::endl;
+    }
+    return ret_val;
+}
 
-        else if (cmd == "") {
-            ; // do nothing
+// Runs the commands in a file without prompts. The file is mapped and
+// parsed in place, and metadata is committed in groups of BATCH_GROUP
+// commands rather than JOURNAL_GROUP. The batch is synced to the disk
+// before it returns. Returns -1 if a command failed.
+static int run_batch(FS& fs, const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Error: can't open " << path << std::endl;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    const char *data = nullptr;
+    if (st.st_size > 0) {
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
         }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        data = (const char*)map;
+    }
+    close(fd);
+
+    // a batch run from a batch puts back the setting of the outer one
+    unsigned group_ops, group_delay;
+    fs.get_commit_group(&group_ops, &group_delay);
+    fs.set_commit_group(BATCH_GROUP, BATCH_DELAY_MS);
+    shell_input in = {data, data + st.st_size, true};
+    command_line cmd;
+    int failed = 0;
+    while (in.running && in.pos < in.end) {
+        const char *line = in.pos;
+        const char *nl = (const char*)memchr(line, '\n', in.end - line);
+        in.pos = nl ? nl + 1 : in.end;
+        split(line, nl ? nl : in.end, cmd);
+        if (cmd.count == 0)
+            continue;
+        if (execute(fs, cmd, in))
+            failed++;
+    }
+    fs.set_commit_group(group_ops, group_delay);
+    if (data)
+        munmap((void*)data, st.st_size);
+
+    if (fs.sync())
+        return -1;
+    return failed ? -1 : 0;
+}
+
+Shell::Shell()
+{
+    std::cout << "Starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+void
+Shell::run()
+{
+    std::string line;
+    command_line cmd;
+    shell_input in = {nullptr, nullptr, true};
+    while (in.running) {
+        std::cout << "filesystem> ";
+        if (!std::getline(std::cin, line))
+            break;
+        split(line.data(), line.data() + line.size(), cmd);
 
-        else {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+        if (DEBUG) {
+            std::cout << "Line: " << line << std::endl;
+            for (unsigned i = 0; i < cmd.count && i < MAX_WORDS; ++i)
+                std::cout << "cmd/arg: " << cmd.words[i].str() << "\n";
         }
+
+        if (cmd.count == 0)
+            continue; // do nothing
+        execute(filesystem, cmd, in);
     }
 }
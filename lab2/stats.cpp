@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <string>
+#include <algorithm>
+#include "stats.h"
+
+
+void op_stats::record(uint64_t ns, uint64_t bytes) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    this->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    unsigned long max = max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        ;
+    uint64_t us = ns / 1000;
+    unsigned b = 0;
+    while (us > 0 && b < STATS_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    buckets[b].fetch_add(1, std::memory_order_relaxed);
+}
+
+void op_stats::reset() {
+    count = 0;
+    bytes = 0;
+    total_ns = 0;
+    max_ns = 0;
+    for (auto &b : buckets)
+        b = 0;
+}
+
+double op_stats::percentile(double p) const {
+    unsigned long n = count.load(std::memory_order_relaxed);
+    if (n == 0)
+        return 0;
+    // the top of the bucket, but no more than the slowest call
+    double max_us = max_ns.load(std::memory_order_relaxed) / 1000.0;
+    unsigned long seen = 0;
+    for (unsigned b = 0; b < STATS_BUCKETS - 1; b++) {
+        seen += buckets[b].load(std::memory_order_relaxed);
+        if (seen * 100.0 >= p * n)
+            return std::min((double)(1ul << b), max_us);
+    }
+    return max_us;
+}
+
+void stats_header(std::ostream& out) {
+    char line[128];
+    snprintf(line, sizeof(line), "%-14s %10s %10s %10s %10s %10s %14s\n",
+             "call", "count", "avg_us", "p50_us", "p99_us", "max_us", "bytes");
+    out << line;
+}
+
+void stats_line(std::ostream& out, const std::string& name, const op_stats& s) {
+    unsigned long n = s.count;
+    if (n == 0)
+        return;
+    char line[160];
+    snprintf(line, sizeof(line), "%-14s %10lu %10.1f %10.0f %10.0f %10.1f %14lu\n",
+             name.c_str(), n, s.total_ns / 1000.0 / n, s.percentile(50),
+             s.percentile(99), s.max_ns / 1000.0, (unsigned long)s.bytes);
+    out << line;
+}
+
+void stats_json(std::ostream& out, const std::string& name, const op_stats& s) {
+    unsigned long n = s.count;
+    out << "{\"name\": \"" << name << "\""
+        << ", \"count\": " << n
+        << ", \"bytes\": " << s.bytes
+        << ", \"total_us\": " << s.total_ns / 1000.0
+        << ", \"max_us\": " << s.max_ns / 1000.0
+        << ", \"p50_us\": " << s.percentile(50)
+        << ", \"p99_us\": " << s.percentile(99)
+        << ", \"histogram_us\": [";
+    // trailing empty buckets are left out
+    unsigned last = 0;
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+        if (s.buckets[b])
+            last = b + 1;
+    }
+    for (unsigned b = 0; b < last; b++)
+        out << (b ? ", " : "") << s.buckets[b];
+    out << "]}";
+}
@@ -0,0 +1,60 @@
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+// latency histogram buckets: bucket 0 holds calls under 1 us, bucket i
+// calls of [2^(i-1), 2^i) us, the last one everything slower
+#define STATS_BUCKETS 28
+
+// Counters of one kind of call: how many, the bytes they moved and a
+// histogram of their latencies. Updated with relaxed atomics, so it is
+// cheap enough to be always on and safe to update from several threads.
+// A snapshot taken while calls run may be off by the calls in flight.
+struct op_stats {
+    std::atomic<unsigned long> count;
+    std::atomic<unsigned long> bytes;
+    std::atomic<unsigned long> total_ns;
+    std::atomic<unsigned long> max_ns;
+    std::atomic<unsigned long> buckets[STATS_BUCKETS];
+    op_stats() { reset(); }
+    void record(uint64_t ns, uint64_t bytes);
+    void reset();
+    // upper bound in microseconds of the latency p percent of the calls
+    // are within, from the histogram
+    double percentile(double p) const;
+};
+
+// records the latency of a call from construction to destruction
+class stats_timer {
+private:
+    op_stats &stats;
+    uint64_t bytes;
+    std::chrono::steady_clock::time_point start;
+public:
+    explicit stats_timer(op_stats &stats, uint64_t bytes = 0)
+        : stats(stats), bytes(bytes), start(std::chrono::steady_clock::now()) {}
+    ~stats_timer() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        stats.record(ns, bytes);
+    }
+    stats_timer(const stats_timer&) = delete;
+    stats_timer& operator=(const stats_timer&) = delete;
+    // bytes moved, when they are only known at the end of the call
+    void set_bytes(uint64_t n) { bytes = n; }
+};
+
+// one line of a table of calls, stats_header() prints its heading. Calls
+// that never happened are left out.
+void stats_header(std::ostream& out);
+void stats_line(std::ostream& out, const std::string& name, const op_stats& s);
+// the same as a JSON object, with the histogram
+void stats_json(std::ostream& out, const std::string& name, const op_stats& s);
+
+#endif // __STATS_H__
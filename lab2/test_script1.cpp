@@ -178,7 +178,7 @@ Shell::run()
 
     std::cout << "56 char names should give an error..." << std::endl;
     std::cout << "Expected output:" << std::endl;
-    std::cout << " ... some error message" << std::endl;
+    std::cout << "Error: create AbcdefghijAbcdefghijAbcdefghijAbcdefghijAbcdefghijAbcdeX failed, error code -1" << std::endl;
     std::cout << "name\t size" << std::endl;
     std::cout << "AbcdefghijAbcdefghijAbcdefghijAbcdefghijAbcdefghijAbcde\t 16" << std::endl;
     std::cout << "Actual output:" << std::endl;
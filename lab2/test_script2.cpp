@@ -224,6 +224,24 @@ Shell::run()
     std::cout << "... done append(f1,f3)" << std::endl;
     PRINTDIV2;
 
+    std::cout << "Testing a descriptor of a removed file..." << std::endl;
+    std::cout << "execute open(f1), rm(f1), create(f4)..." << std::endl;
+    int file = filesystem.open("f1");
+    filesystem.rm("f1");
+    filesystem.create("f4", "SECRET\n", 7);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "pread(fd) failed" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    char buf[16];
+    ret_val = filesystem.pread(file, 0, sizeof(buf), buf);
+    if (ret_val < 0)
+        std::cout << "pread(fd) failed" << std::endl;
+    else
+        std::cout << "pread(fd) read " << std::string(buf, ret_val);
+    filesystem.close(file);
+    std::cout << "... done removed descriptor" << std::endl;
+    PRINTDIV2;
+
     std::cout << "... Task 2 done" << std::endl;
     PRINTDIV;
 
@@ -0,0 +1,336 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+// scratch disks of the journal and cache tests, next to the disk of the shell
+#define JOURNAL_DISK "journaltest.bin"
+#define CRASH_DISK "journalcrash.bin"
+
+std::string commands_str[] = {
+    "format", "create", "cat", "ls",
+    "cp", "mv", "rm", "append",
+    "mkdir", "cd", "pwd",
+    "chmod",
+    "help", "quit"
+};
+
+// copies what is on the disk file right now, as a crash would leave it
+static void crash_copy(const std::string& from, const std::string& to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    out << in.rdbuf();
+}
+
+// prints len bytes of block_no, '.' for zero bytes
+static void print_bytes(Cache& cache, unsigned block_no, unsigned offset, unsigned len) {
+    char buf[BLOCK_SIZE];
+    cache.read_range(block_no, offset, buf, len);
+    for (unsigned i = 0; i < len; i++)
+        std::cout << (buf[i] ? buf[i] : '.');
+    std::cout << std::endl;
+}
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+void
+Shell::run()
+{
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 6 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing replay after the log starts over..." << std::endl;
+    std::cout << "Journal of 1000 blocks, cache of 4096 blocks..." << std::endl;
+    unlink(JOURNAL_DISK);
+    {
+        Disk disk(JOURNAL_DISK, 8192);
+        Cache cache(disk, 4096);
+        Journal journal(disk, cache);
+        journal.init(1000, 1000);
+        journal.reset();
+        // one operation changing a small part of block_no and count
+        // whole blocks from first
+        auto commit = [&](unsigned block_no, unsigned offset, const char *data,
+                          unsigned first, unsigned count) {
+            uint8_t full[BLOCK_SIZE];
+            std::memset(full, 'x', BLOCK_SIZE);
+            journal.begin_op();
+            if (data) {
+                cache.write_range(block_no, offset, data, strlen(data));
+                journal.add(block_no);
+            }
+            for (unsigned b = first; b < first + count; b++) {
+                cache.write(b, full);
+                journal.add(b);
+            }
+            journal.end_op();
+            journal.commit();
+        };
+
+        std::cout << "fill the log to 742 blocks, the last commit has AAAA at offset 0 of block 2100..." << std::endl;
+        commit(0, 0, nullptr, 3000, 250);
+        commit(0, 0, nullptr, 3250, 250);
+        commit(2100, 0, "AAAA", 3500, 235);
+        std::cout << "commit BBBB at offset 200 of block 2100 with 300 more blocks..." << std::endl;
+        commit(2100, 200, "BBBB", 4000, 300);
+        std::cout << "log restarts: " << journal.get_checkpoints() << std::endl;
+
+        std::cout << "crash and replay..." << std::endl;
+        crash_copy(JOURNAL_DISK, CRASH_DISK);
+    }
+    {
+        Disk disk(CRASH_DISK);
+        Cache cache(disk, 4096);
+        Journal journal(disk, cache);
+        journal.init(1000, 1000);
+        journal.replay();
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "AAAA" << std::endl;
+        std::cout << "BBBB" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        print_bytes(cache, 2100, 0, 4);
+        print_bytes(cache, 2100, 200, 4);
+    }
+    unlink(JOURNAL_DISK);
+    unlink(CRASH_DISK);
+    std::cout << "... done replay after restart" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing group commit..." << std::endl;
+    std::cout << "Journal committing groups of 4 operations..." << std::endl;
+    unlink(JOURNAL_DISK);
+    {
+        Disk disk(JOURNAL_DISK, 8192);
+        Cache cache(disk, 64);
+        Journal journal(disk, cache);
+        journal.init(1000, 100);
+        journal.reset();
+        journal.set_group(4, 10000);
+        unsigned long commits = journal.get_commits();
+        // one operation changing the first byte of block_no
+        auto op = [&](unsigned block_no) {
+            journal.begin_op();
+            cache.write_range(block_no, 0, "G", 1);
+            journal.add(block_no);
+            journal.end_op();
+        };
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "commits after 4 operations: 0" << std::endl;
+        std::cout << "commits after 5 operations: 1" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        for (unsigned b = 2000; b < 2004; b++)
+            op(b);
+        std::cout << "commits after 4 operations: " << journal.get_commits() - commits << std::endl;
+        op(2004);
+        std::cout << "commits after 5 operations: " << journal.get_commits() - commits << std::endl;
+    }
+    unlink(JOURNAL_DISK);
+    std::cout << "... done group commit" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing logging of the changed bytes only..." << std::endl;
+    std::cout << "100 blocks of y at home, one operation changes 4 bytes of each..." << std::endl;
+    unlink(JOURNAL_DISK);
+    {
+        Disk disk(JOURNAL_DISK, 8192);
+        Cache cache(disk, 256);
+        Journal journal(disk, cache);
+        journal.init(1000, 1000);
+        journal.reset();
+        uint8_t full[BLOCK_SIZE];
+        std::memset(full, 'y', BLOCK_SIZE);
+        for (unsigned b = 3000; b < 3100; b++)
+            cache.write(b, full);
+        cache.sync();
+        unsigned long written = disk.get_blocks_written();
+        journal.begin_op();
+        for (unsigned b = 3000; b < 3100; b++) {
+            cache.write_range(b, 100, "RRRR", 4);
+            journal.add(b);
+        }
+        journal.end_op();
+        journal.commit();
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "blocks logged: 3" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::cout << "blocks logged: " << disk.get_blocks_written() - written << std::endl;
+        std::cout << "crash and replay..." << std::endl;
+        crash_copy(JOURNAL_DISK, CRASH_DISK);
+    }
+    {
+        Disk disk(CRASH_DISK);
+        Cache cache(disk, 256);
+        Journal journal(disk, cache);
+        journal.init(1000, 1000);
+        journal.replay();
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "yyRRRRyy" << std::endl;
+        std::cout << "yyRRRRyy" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        print_bytes(cache, 3000, 98, 8);
+        print_bytes(cache, 3099, 98, 8);
+    }
+    unlink(JOURNAL_DISK);
+    unlink(CRASH_DISK);
+    std::cout << "... done logging of changed bytes" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing replay of a mounted file system..." << std::endl;
+    std::cout << "Committing every operation when the next one starts..." << std::endl;
+    unlink(JOURNAL_DISK);
+    {
+        FS fs(JOURNAL_DISK);
+        fs.format();
+        fs.set_commit_group(1, 10000);
+        std::cout << "execute create(f), mkdir(d)..." << std::endl;
+        fs.create("f", "committed\n", 10);
+        fs.mkdir("d");
+        std::cout << "crash and mount again..." << std::endl;
+        crash_copy(JOURNAL_DISK, CRASH_DISK);
+    }
+    {
+        FS fs(CRASH_DISK);
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "committed" << std::endl;
+        std::cout << "d: not found" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        fs.cat("f");
+        std::cout << "d: " << (fs.cd("d") ? "not found" : "found") << std::endl;
+    }
+    unlink(JOURNAL_DISK);
+    unlink(CRASH_DISK);
+    std::cout << "... done replay of a file system" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing readahead..." << std::endl;
+    std::cout << "16 blocks of a to p at home, read ahead, block 5005 written meanwhile..." << std::endl;
+    unlink(JOURNAL_DISK);
+    {
+        Disk disk(JOURNAL_DISK, 8192);
+        {
+            Cache cache(disk, 64);
+            uint8_t blk[BLOCK_SIZE];
+            for (unsigned i = 0; i < 16; i++) {
+                std::memset(blk, 'a' + i, BLOCK_SIZE);
+                cache.write(5000 + i, blk);
+            }
+            cache.sync();
+        }
+        Cache cache(disk, 64);
+        std::vector<unsigned> block_nos;
+        for (unsigned b = 5000; b < 5016; b++)
+            block_nos.push_back(b);
+        cache.readahead(block_nos);
+        uint8_t blk[BLOCK_SIZE];
+        std::memset(blk, 'N', BLOCK_SIZE);
+        cache.write(5005, blk);
+        // already cached, nothing more is read
+        cache.readahead(block_nos);
+        std::string firsts;
+        for (unsigned b = 5000; b < 5016; b++) {
+            cache.read(b, blk);
+            firsts += (char)blk[0];
+        }
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "abcdeNghijklmnop" << std::endl;
+        std::cout << "blocks read ahead: 16" << std::endl;
+        std::cout << "misses: 0" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::cout << firsts << std::endl;
+        std::cout << "blocks read ahead: " << cache.get_readaheads() << std::endl;
+        std::cout << "misses: " << cache.get_misses() << std::endl;
+    }
+    unlink(JOURNAL_DISK);
+    std::cout << "... done readahead" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing a write to one of two copies..." << std::endl;
+    std::cout << "Starting with empty disk..." << std::endl;
+    filesystem.format();
+    {
+        std::string big(3 * BLOCK_SIZE, 'a');
+        filesystem.create("f1", "hej heja hejare\n", 16);
+        filesystem.create("big1", big.data(), big.size());
+        std::cout << "execute cp(f1,f2), cp(big1,big2)..." << std::endl;
+        filesystem.cp("f1", "f2");
+        filesystem.cp("big1", "big2");
+        std::cout << "execute pwrite(f2,0,HOJ), pwrite(big2,8192,bbbb)..." << std::endl;
+        filesystem.pwrite("f2", 0, 3, "HOJ");
+        filesystem.pwrite("big2", 2 * BLOCK_SIZE, 4, "bbbb");
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "hej heja hejare" << std::endl;
+        std::cout << "HOJ heja hejare" << std::endl;
+        std::cout << "big1: aaaa" << std::endl;
+        std::cout << "big2: bbbb" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        filesystem.cat("f1");
+        filesystem.cat("f2");
+        char buf[4];
+        filesystem.pread("big1", 2 * BLOCK_SIZE, 4, buf);
+        std::cout << "big1: " << std::string(buf, 4) << std::endl;
+        filesystem.pread("big2", 2 * BLOCK_SIZE, 4, buf);
+        std::cout << "big2: " << std::string(buf, 4) << std::endl;
+    }
+    std::cout << "... done copy-on-write" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing an open file changed through its path..." << std::endl;
+    std::cout << "Starting with empty disk..." << std::endl;
+    filesystem.format();
+    {
+        filesystem.create("f", "0123456789", 10);
+        filesystem.create("tail", "abc\n", 4);
+        filesystem.mkdir("d");
+        std::cout << "execute fd = open(f), append(tail,f), read(fd,14)..." << std::endl;
+        int fd = filesystem.open("f");
+        filesystem.append("tail", "f");
+        char buf[16] = {0};
+        int n = filesystem.read(fd, buf, 14);
+        std::cout << "execute mv(f,d/g), write(fd,XYZ), cat(d/g)..." << std::endl;
+        filesystem.mv("f", "d/g");
+        int w = filesystem.write(fd, "XYZ", 3);
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "read 14: 0123456789abc" << std::endl;
+        std::cout << "wrote 3" << std::endl;
+        std::cout << "0123456789abc" << std::endl;
+        std::cout << "XYZ" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::cout << "read " << n << ": " << buf;
+        std::cout << "wrote " << w << std::endl;
+        filesystem.cat("d/g");
+        std::cout << std::endl;
+        std::cout << "execute rm(d/g), write(fd,XYZ), close(fd)..." << std::endl;
+        filesystem.rm("d/g");
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "write: -1" << std::endl;
+        std::cout << "close: 0" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::cout << "write: " << filesystem.write(fd, "XYZ", 3) << std::endl;
+        std::cout << "close: " << filesystem.close(fd) << std::endl;
+    }
+    std::cout << "... done open file" << std::endl;
+    PRINTDIV2;
+
+    std::cout << "... Task 6 done" << std::endl;
+    PRINTDIV;
+}